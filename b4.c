@@ -3,7 +3,7 @@
   b4.c by Nancy Sadkov
   License: Public Domain (CC0)
 
-  Compile: cc b4.c -o b4
+  Compile: cc b4.c -o b4 -pthread
 
   4-bit opcode size virtual machine.
   Think Brainfuck but fast.
@@ -17,22 +17,12 @@
   BCD encoding is special, since it uses the codes 0xA and 0xB,
   which act as both stream terminators and values.
   C, D, E and F can't be used, due to coinciding with [<]> codes in 4bit.
+  Right after the 0 they select the extension ops instead.
 
   TODO:
-  * `intern` directive for the macro processor
-    it will pre-intern the symbols, without leaving ids in the bytecode
   * Loop which go towards zero if counter is negative
   * Optimized implementation which can do 2,3,4 opcodes at a time
     for CPUs with huge code caches.
-  * Macros:
-    '{...}': when preceeded by 'Name(Arg0 Arg1 ... ArgN}' defines a macro
-         If Name begins with a digit, collect digits till the matching '}',
-         then otput the code to generate that number.
-         For example,
-           PRINT3 {3[PRINT/1-]} ; loop 3 times printing the loop counter
-         if it is an alphabet character, get the value for it.
-         For example,
-           {Count=123} 
 
 Examples:
   'Hello, World!'.say  ; print hello world (29 bytes)
@@ -44,8 +34,10 @@ Examples:
   %[.top=]             ; print 0 terminated string's bytes (5 bytes)
   1[1=]                ; endless loop (4 bytes)
   bool:[1@]?:          ; returns 1 if integer is not 0, or 0 (3 bytes)
-  and:[[1@]?@]!?:      ; logical and (8 bytes)
+  and:[[1@]?@]!?:      ; logical and (9 bytes)
   or:[!1@][1@]?:       ; logical or (9 bytes)
+The names get ids after the 27 predefined functions, so a reference to
+one of them takes at least 3 nibbles.
 
 Mnemonics:
 0:N/A: enters BCD input state
@@ -73,10 +65,136 @@ E:'<': pop value, if value <= 0, seek to the code after the next matching '>'.
 F:'>': if the value in the register B is not 0; seek to the matching '<'
 _:'%': duplicate the top element (shorthand for 0$)
 
+Extension ops (0, group C..F, op 1..B):
+C1:'#do':   pop N, if N <= 0, skip past the matching '#loop',
+            else push a loop with index 0 to the loop stack
+C2:'#loop': increment the index, going back after the '#do' while it's < N
+C3:'#i':    push the index of the innermost loop
+C4:'#j':    push the index of the loop around it
+D1:'#div' or '/': pop X, pop Y, push X/Y (like '-', X is the top)
+D2:'#mod':  X%Y; both fail when Y is 0
+D3:'#lt':   1 if X<Y, else 0
+D4:'#eq':   1 if X==Y, else 0
+D5:'#and' or '&', D6:'#or' or '|', D7:'#xor' or '^': bitwise X op Y
+D8:'#shl':  X<<Y
+D9:'#shr':  X>>Y, logical, the shifts take Y modulo 32
+The loop stack is separate from the data stack and from A, so the loops
+nest without juggling their counters. `@` drops the function's loops.
+  3#do 4#do #j 10* #i+ #loop #loop   ; pushes 0 1 2 3 10 11 ... 23
+
 Predefined functions:
 top: print the value at the top of the stack without popping it.
 say: print 0-terminated string on stack.
 hlt: termiante execution
+flush: write out the buffered output.
+eval: assemble 0-terminated string on stack, pushing id of its function.
+      'dbl:2*:'.eval.  21.dbl   ; defines dbl at runtime
+memo: id.memo keeps the results of the function, skipping the runs with
+      the same arguments. Fails unless the function is pure: stack code
+      calling pure functions only, with a fixed number of values in and
+      out, up to 4. The table is bounded, -p shows its hit rate.
+      fib.memo 30.fib
+The range functions take a count N from the top, working on the N values
+below it with SIMD:
+vsum, vmin, vmax: replace the range with its sum, minimum or maximum.
+vfill: V N .vfill pushes N copies of V.
+vrev: reverses the range.
+vrot: range K N .vrot rotates the range K places towards the top.
+vlen: push the number of values above the topmost 0 (a string's length).
+vcpy: S D N .vcpy copies N values from the depth S to the depth D,
+      the depths being of the ranges' tops, after popping the arguments.
+  1 2 3 4 4.vsum     ; 10
+
+Memory: a linear byte array, growing in pages, with addresses from 0.
+ld, ldb: A .ld pushes the 32-bit value (or the byte) at A.
+st, stb: V A .st stores V at A.
+mcpy: S D N .mcpy copies N bytes from S to D.
+mfill: V A N .mfill sets N bytes at A to V.
+msize: push the memory size.
+mgrow: N .mgrow grows the memory by N bytes, pushing the old size.
+mfile: 'path'.mfile maps the file at the end of the memory, pushing its
+       address and size. The mapping is private, writes don't reach the file.
+slurp: the same for the stdin, which gets read in when it's a pipe.
+rec: P E D .rec pushes the offset Q of the first byte D in [P, E), or E,
+     so the record is [P, Q) and the next one starts at Q+1.
+  .slurp 1$+, 0 1[1$3$10.rec,1+,1+2 0-$2$2$#lt=]  ; counts the lines
+
+Output is collected in a buffer and written with large write(2) calls,
+when the buffer gets full, on `flush` or on exit.
+
+Macros:
+  {...}            ; assembled and ran at assembly time, the values it
+                   ; leaves on the stack are spliced in as literals
+  Name(A B){body}  ; defines a macro with parameters A and B
+  Name(x y)        ; expands into body, with A and B replaced by x and y
+  intern(a b c)    ; interns the names, without emitting their ids
+For example,
+  sq(X){X X*} {100 sq(3)+}  ; becomes the literal 109
+
+Source files:
+  b4 -f prog.b4                ; run the source file, `-` for the stdin
+Files are mapped or read in chunks, so they can be of any size.
+  b4 -j 8 -f prog.b4           ; assemble large sources using 8 threads
+
+Images:
+  b4 -o prog.b4c 'expression'  ; compile into a .b4c image
+  b4 -r prog.b4c               ; run the image
+  b4 -w warm.b4c ...           ; run, then save the image with the jumps
+                               ; resolved during the run
+The image holds the nibble code, the name table and the extents of
+the top level definitions. It is mmaped and executed in place.
+A warm image also carries the jump targets, so its runs skip the bracket
+scans, and the extents let `:` skip scanning for the closing `:`.
+Its adjacent top level definitions are reordered by their call and back
+jump counts during the run, the hottest first and the unused last, so the
+hot code ends up packed together. b4 code is position independent, only
+the jump targets move with it.
+
+  b4 -l out.b4c a.b4c b.b4c    ; link the modules compiled with -o
+The linker renumbers the name ids of each module and drops definitions
+identical to the previous definition of the same name.
+
+  b4 -t ...                    ; strip the definitions nothing can call
+  b4 -T ...                    ; same, assuming computed calls (`?.`)
+                               ; only target ids appearing as literals
+
+  b4 -O ...                    ; optimize the straight line code: folds
+                               ; literals, resolves `$` with literal
+                               ; indices, drops dead values and stores
+                               ; and sums the affine loops, like `[?+]`,
+                               ; in closed form
+  b4 -O -L ...                 ; same, leaving the loops to the interpreter
+  b4 -H ...                    ; optimize only the functions getting hot,
+                               ; moving a running loop into the new code
+                               ; and inlining the short functions called,
+                               ; until they get redefined; a call with
+                               ; literal arguments goes to a copy of the
+                               ; callee built and optimized for them
+  b4 -p ...                    ; print the call and back jump counts
+
+  b4 -c dir 'expression'       ; cache compiled expressions in `dir`
+                               ; B4CACHE=dir does the same
+
+Errors:
+A failure unwinds to b4cmd(), which returns its kind, message, ip and
+function, leaving the VM reset and usable. Without a caller to
+return to, like while compiling, it ends the process.
+
+Server:
+  b4 -d -                      ; run the lines of the stdin as commands
+  b4 -d path                   ; same, for a FIFO or a UNIX socket at path
+The VM stays warm between the commands, so a definition made by one
+is there for the next. Each reply is the output and the stack, ending
+with a `.` line. A failing command only resets the stack and A.
+A line starting with `~` is a what-if: it runs in a forked copy of the
+VM, which replies and goes away, leaving the server's state as it was.
+It doesn't store its compilations in the cache directory either.
+
+Snapshots:
+  b4 -f prelude.b4 -s pre.b4s  ; run, then save the whole VM state
+  b4 -S pre.b4s ...            ; start from the state, then run or serve
+The restored VM maps the snapshot's code, jumps and functions as
+copy-on-write pages, so its startup doesn't grow with the prelude.
 
 
 *******************************************************************************/
@@ -86,6 +204,17 @@ hlt: termiante execution
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #define S static
 
@@ -95,12 +224,19 @@ typedef uint8_t C;  //type of the code value
 
 #define MAXSP 1024
 #define MAXFR 1024
-#define MAXFN 1024
-#define MAXNP 1024
+#define MAXFN (64*1024)
+#define MAXNP (64*1024)
 #define MAXNM 256
+#define MAXLS 256 //loop stack
 
 #define BADIP (-1)
 
+#define OBSZ (64*1024) //output buffer size
+
+#define B4C_MAGIC "b4c\x1A"
+#define B4C_VER 8
+#define B4C_BCD 1 //literal encoding: nibble BCD with A/B terminators
+
 enum { //opcodes
   C_BCD, //0: read BCD
   C_ADD, //1: pop X, pop Y, push X+Y
@@ -120,29 +256,172 @@ enum { //opcodes
   C_JBC, //F: jump on B closing
 };
 
+/* Extension ops are encoded as C_BCD, a group nibble 12..15 and an op
+   nibble 1..11. Literals never hold a nibble above 11 and no op nibble
+   is 0, so a 0 followed by a nibble above 11 always starts an extension,
+   whichever direction the code is scanned in. The codes are group<<4|op.
+*/
+#define C_EXT 16 //dec() op of the extensions
+
+enum {
+  X_DO = 0xC1, //pop N, if N <= 0 skip past the matching #loop
+  X_LOOP,      //increment the index, repeating the body while it's below N
+  X_I,         //push the index of the innermost loop
+  X_J,         //push the index of the loop around it
+  X_DIV = 0xD1, //pop X, pop Y, push X/Y, failing when Y is 0
+  X_MOD,        //X%Y, failing when Y is 0
+  X_LT,         //X<Y
+  X_EQ,         //X==Y
+  X_AND,        //X&Y
+  X_OR,         //X|Y
+  X_XOR,        //X^Y
+  X_SHL,        //X<<Y, Y taken modulo 32
+  X_SHR,        //X>>Y, logical, Y taken modulo 32
+};
+
 
 S T st[MAXSP];
 S int sp, fp, np;
-S struct { P start, end, ip; T ra; } fr[MAXFN]; //frames
-S struct { P start, end; } fn[MAXFR]; //functions
+S int npre; //predefined names
+S struct { P start, end, ip; T ra, id; int lsp, mm; } fr[MAXFR]; //frames
+typedef struct { P start, end; } Fn;
+S Fn fn0[MAXFN], *fn = fn0; //functions, mapped when restored from a snapshot
 S char *nm[MAXNP]; //names
-S C *code;
+typedef struct { T id; P def, start, end; } Fx; //function extents
+S Fx *fx; //extents of the loaded images, sorted by start
+S int nfx;
+S C *code; //code heap
 S P *jtbl; //we can use a few values cache if memory is a concern
 S P ip, start, end;
 S T ra; //register A
-S char name[MAXNM];
+S struct { T i, n; } ls[MAXLS]; //loop stack: index and count
+S int lsp;
+S char ob[OBSZ]; //output buffer
+S int on; //bytes in the output buffer
+S int ofd = 1; //where the output goes
+
+enum { //error kinds
+  E_NONE,
+  E_HALT,  //hlt was called
+  E_ASM,   //the source doesn't assemble
+  E_CODE,  //bad literal or extension, unmatched bracket
+  E_CALL,  //call of an undefined function
+  E_ARITH, //division by zero
+  E_RANGE, //stack overflow, bad stack range, memory address or loop
+  E_LIMIT, //out of names or memory
+  E_IO,    //files and sockets
+};
 
-#define push(v) (st[sp++] = (v))
+typedef struct {
+  int kind;
+  P ip;  //where the VM was
+  T fn;  //the function it was running, -1 if none
+  char msg[256];
+} B4Err;
+
+S __thread jmp_buf *onfail; //where fail() goes, instead of exiting
+S __thread B4Err err; //the last failure
+
+#define push(v) do { \
+  T v_ = (v); \
+  if (sp == MAXSP) fail(E_RANGE, "Stack overflow\n"); \
+  st[sp++] = v_; \
+} while (0)
 #define pop (st[--sp])
 #define top (st[sp-1])
 
+#define nib(q,p) (((p)&1) ? (q)[(p)/2]>>4 : (q)[(p)/2]&0xF)
+
 #define rd ((ip&1) ? code[ip++/2]>>4 : code[ip++/2]&0xF)
 #define pk ((ip&1) ? code[ip/2]>>4 : code[ip/2]&0xF)
 #define pr ((ip&1) ? code[(ip-1)/2]>>4 : code[(ip-1)/2]&0xF)
 
 S void jmp(C open, C close, P inc, P end);
+S void xop(int x);
+
+S void obflush() {
+  char *p = ob;
+  while (on > 0) {
+    ssize_t n = write(ofd, p, on);
+    if (n <= 0) break;
+    p += n;
+    on -= n;
+  }
+  on = 0;
+}
+
+#define obc(c) do {if (on == OBSZ) obflush(); ob[on++] = (c);} while(0)
+
+S void obw(const char *s, int n) {
+  if (on + n > OBSZ) {
+    obflush();
+    if (n > OBSZ) {
+      while (n > 0) { //too big to be buffered
+        ssize_t k = write(ofd, s, n);
+        if (k <= 0) return;
+        s += k;
+        n -= k;
+      }
+      return;
+    }
+  }
+  memcpy(ob+on, s, n);
+  on += n;
+}
+
+S void obs(const char *s) {obw(s, strlen(s));}
+
+S void obint(T v) {
+  char b[12], *e = b+sizeof(b), *d = e;
+  uint32_t u = v < 0 ? -(uint32_t)v : (uint32_t)v;
+  do { *--d = '0' + u%10; u /= 10; } while (u);
+  if (v < 0) *--d = '-';
+  obw(d, e-d);
+}
+
+//formatted output for the cold paths, like error messages
+S void vobf(const char *fmt, va_list ap) {
+  char b[256];
+  int n = vsnprintf(b, sizeof(b), fmt, ap);
+  obw(b, n < (int)sizeof(b) ? n : (int)sizeof(b)-1);
+}
+
+S void obf(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vobf(fmt, ap);
+  va_end(ap);
+}
+
+//the innermost function around `p`
+S T efn(P p) {
+  T id = -1;
+  for (T i = 0; i < np && i < MAXFN; i++)
+    if (fn[i].end && fn[i].start <= p && p < fn[i].end
+        && (id < 0 || fn[i].start >= fn[id].start)) id = i;
+  return id;
+}
+
+S void perr(B4Err *e) {
+  obs(e->msg);
+  if (e->fn >= 0) obf("  at %d in `%s`\n", e->ip, nm[e->fn]);
+}
+
+//records the error, then unwinds to onfail, or exits when it's unset
+__attribute__((noreturn)) S void fail(int kind, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  err.kind = kind;
+  err.ip = ip;
+  err.fn = kind == E_ASM || kind == E_HALT || !fp ? -1 : efn(ip-1);
+  vsnprintf(err.msg, sizeof(err.msg), fmt, ap);
+  va_end(ap);
+  if (onfail) longjmp(*onfail, 1);
+  perr(&err);
+  obflush();
+  exit(-1);
+}
 
-S P dp(P p) {printf("dp:%d\n", p); return p;}
 S C dc(C c) {printf("dc:%d\n", c); return c;}
 
 enum {BCD_N=10, BCD_P=11}; //normal or prefixed
@@ -160,56 +439,459 @@ S void bcd() {
     v += b*(c==BCD_P);
     push(v);
     return;
-  //below can be put at the beginning of bytecode to indicate special parameters
-  //like syscalls and architecture extensions.
+  //at the beginning, these select an extension op group
   case 12: case 13: case 14: case 15:
-    printf("Bad BCD `%d`\n", c);
-    exit(-1);
+    if (b != 1) fail(E_CODE, "Bad BCD `%d`\n", c);
+    xop(c<<4 | rd);
+    return;
   }
 }
 
-//FIXME: put predefined functions into a table.
-enum { SI_TOP, SI_SAY, SI_HLT};
+/* Predefined functions. The id of each is its place in the table,
+   so the images depend on the order.
+*/
+S void evl();
+S char *spop();
 
-S void swi(T id) {
-  switch (id) {
-  case SI_TOP: printf("top: %d\n", top); break;
-  case SI_SAY: {
-    int e = sp;
-    int s = sp;
-    while (s && st[s]) s--;
-    sp = s;
-    while (s < e) putchar(st[s++]);
-    putchar('\n');
-    break;
+S void ntop() {
+  if (on + 20 > OBSZ) obflush();
+  memcpy(ob+on, "top: ", 5);
+  on += 5;
+  obint(top);
+  ob[on++] = '\n';
+}
+
+/* Range natives work on the N values below the count N on the top,
+   with GCC vector extensions over st[], VW values at a time.
+*/
+typedef uint32_t VU __attribute__((vector_size(32)));
+typedef T VS __attribute__((vector_size(32)));
+#define VW (int)(sizeof(VU)/sizeof(T))
+
+//pops the count, returning the range below it
+S T *vrange(T *n) {
+  *n = pop;
+  if (*n < 0 || *n > sp) fail(E_RANGE, "Bad range `%d`\n", *n);
+  return st+sp-*n;
+}
+
+//the number of values above the topmost 0
+S int zscan() {
+  int s = sp;
+  while (s >= VW) {
+    VS v, z;
+    memcpy(&v, st+s-VW, sizeof(v));
+    z = v == 0;
+    VU u = (VU)z;
+    uint32_t any = 0;
+    for (int i = 0; i < VW; i++) any |= u[i];
+    if (any) break;
+    s -= VW;
+  }
+  while (s && st[s-1]) s--;
+  return sp-s;
+}
+
+S void nsay() {
+  int e = sp;
+  int s = sp-zscan();
+  sp = s ? s-1 : 0;
+  while (s < e) { //copy the whole run at once
+    int n = e-s < OBSZ-on ? e-s : OBSZ-on;
+    char *d = ob+on;
+    for (int i = 0; i < n; i++) d[i] = st[s+i];
+    on += n;
+    s += n;
+    if (on == OBSZ) obflush();
+  }
+  obc('\n');
+}
+
+S void nhlt() {fail(E_HALT, "");}
+
+//closed form of the affine loop: acc += a*A+b, A going to 0
+S void nlaff() {
+  uint32_t b = pop, a = pop, u = ra;
+  uint32_t t = (uint64_t)u*(u+1)/2;
+  top += a*t + b*(u+1);
+  ra = 0;
+}
+
+S void nvsum() {
+  T n, *r = vrange(&n);
+  VU acc = {0};
+  int i = 0;
+  for (; i+VW <= n; i += VW) {
+    VU v;
+    memcpy(&v, r+i, sizeof(v));
+    acc += v;
+  }
+  uint32_t s = 0;
+  for (int j = 0; j < VW; j++) s += acc[j];
+  for (; i < n; i++) s += r[i];
+  sp -= n;
+  push(s);
+}
+
+S void vext(int max) {
+  T n, *r = vrange(&n);
+  if (!n) fail(E_RANGE, "Bad range `0`\n");
+  VS m = (VS){0} + r[0];
+  int i = 0;
+  for (; i+VW <= n; i += VW) {
+    VS v, c;
+    memcpy(&v, r+i, sizeof(v));
+    c = max ? v > m : v < m;
+    m = (v & c) | (m & ~c);
+  }
+  T x = m[0];
+  for (int j = 1; j < VW; j++) if (max ? m[j] > x : m[j] < x) x = m[j];
+  for (; i < n; i++) if (max ? r[i] > x : r[i] < x) x = r[i];
+  sp -= n;
+  push(x);
+}
+
+S void nvmin() {vext(0);}
+S void nvmax() {vext(1);}
+
+S void nvfill() {
+  T n = pop, v = pop;
+  if (n < 0 || n > MAXSP-sp) fail(E_RANGE, "Bad range `%d`\n", n);
+  for (T i = 0; i < n; i++) st[sp+i] = v;
+  sp += n;
+}
+
+S void vrev(T *r, T n) {
+  for (T i = 0, j = n-1; i < j; i++, j--) {
+    T t = r[i];
+    r[i] = r[j];
+    r[j] = t;
+  }
+}
+
+S void nvrev() {
+  T n, *r = vrange(&n);
+  vrev(r, n);
+}
+
+//rotates the range below K places towards the top: range K N .vrot
+S void nvrot() {
+  T n = pop, k = pop;
+  push(n);
+  T *r = vrange(&n);
+  if (n < 2) return;
+  k %= n;
+  if (k < 0) k += n;
+  vrev(r, n);
+  vrev(r, k);
+  vrev(r+k, n-k);
+}
+
+S void nvlen() {
+  int n = zscan();
+  push(n);
+}
+
+//copies N values from depth S to depth D, the depths being of the
+//tops of the ranges, after popping the arguments
+S void nvcpy() {
+  T n = pop, d = pop, s = pop;
+  if (n < 0 || s < 0 || d < 0 || s > sp-n || d > sp-n)
+    fail(E_RANGE, "Bad range `%d`\n", n);
+  memmove(st+sp-d-n, st+sp-s-n, n*sizeof(T));
+}
+
+/* Linear memory: a MEMMAX bytes reservation, with the pages up to the
+   size made accessible as it grows. Addresses are byte offsets.
+   Files are mapped privately right into it, so writes never reach them.
+*/
+#define MEMMAX (1<<30)
+
+S char *mem;
+S T msz;      //bytes in use
+S size_t mcap; //bytes accessible
+
+S size_t pgsz() {
+  S size_t n;
+  if (!n) n = sysconf(_SC_PAGESIZE);
+  return n;
+}
+
+#define PGUP(x) (((x)+pgsz()-1) & ~(pgsz()-1))
+
+S void mres() {
+  mem = mmap(0, MEMMAX, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) fail(E_LIMIT, "Can't reserve the memory\n");
+}
+
+//sets the size to n bytes
+S void mset(int64_t n) {
+  if (!mem) mres();
+  if (n < 0 || n > MEMMAX) fail(E_LIMIT, "Out of memory\n");
+  if ((size_t)n > mcap) {
+    size_t c = PGUP((size_t)n);
+    if (mprotect(mem+mcap, c-mcap, PROT_READ|PROT_WRITE)) fail(E_LIMIT, "Out of memory\n");
+    mcap = c;
+  }
+  msz = n;
+}
+
+//checks that [a, a+n) is in the memory
+#define MCHK(a,n) do { \
+  if ((a) < 0 || (n) < 0 || (a) > msz-(n)) fail(E_RANGE, "Bad address `%d`\n", (a)); \
+} while(0)
+
+S void nld() {
+  T a = pop, v;
+  MCHK(a, 4);
+  memcpy(&v, mem+a, 4);
+  push(v);
+}
+
+S void nst() {
+  T a = pop, v = pop;
+  MCHK(a, 4);
+  memcpy(mem+a, &v, 4);
+}
+
+S void nldb() {
+  T a = pop;
+  MCHK(a, 1);
+  push((uint8_t)mem[a]);
+}
+
+S void nstb() {
+  T a = pop, v = pop;
+  MCHK(a, 1);
+  mem[a] = v;
+}
+
+//S D N .mcpy: copies N bytes from S to D
+S void nmcpy() {
+  T n = pop, d = pop, s = pop;
+  MCHK(s, n);
+  MCHK(d, n);
+  memmove(mem+d, mem+s, n);
+}
+
+//V A N .mfill: sets N bytes at A to V
+S void nmfill() {
+  T n = pop, a = pop, v = pop;
+  MCHK(a, n);
+  memset(mem+a, v, n);
+}
+
+S void nmsize() {push(msz);}
+
+//N .mgrow: grows the memory by N bytes, pushing the old size
+S void nmgrow() {
+  T n = pop, o = msz;
+  mset((int64_t)msz + n);
+  push(o);
+}
+
+#define MCHUNK (1<<20) //reads of the unmappable input
+
+//maps the file, or reads what it has left when it can't be mapped,
+//at the next page of the memory, pushing the address and size
+S void mload(int fd, char *name) {
+  struct stat sb;
+  if (!mem) mres();
+  size_t a = PGUP((size_t)msz);
+  if (!fstat(fd, &sb) && S_ISREG(sb.st_mode) && !lseek(fd, 0, SEEK_CUR)) {
+    if (sb.st_size > MEMMAX - (int64_t)a) fail(E_IO, "`%s` is too large\n", name);
+    if (sb.st_size) {
+      if (mmap(mem+a, sb.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED,
+               fd, 0) == MAP_FAILED) fail(E_IO, "Can't map `%s`\n", name);
+      if (a + sb.st_size > mcap) mcap = PGUP(a + sb.st_size);
+    }
+    mset(a + sb.st_size);
+  } else { //a pipe or a terminal: read right into the memory
+    mset(a);
+    for (;;) {
+      T o = msz;
+      mset((int64_t)o + MCHUNK);
+      ssize_t n = read(fd, mem+o, MCHUNK);
+      mset(o + (n > 0 ? n : 0));
+      if (n == 0) break;
+      if (n < 0) fail(E_IO, "Can't read `%s`\n", name);
     }
-  case SI_HLT: exit(-1); break;
-  default:
-    printf("Bad function `%d`\n", id);
-    exit(-1);
   }
+  push(a);
+  push(msz-a);
+}
+
+//'path'.mfile: maps the file into the memory, pushing its address and size
+S void nmfile() {
+  char *path = spop();
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) fail(E_IO, "Can't open `%s`\n", path);
+  mload(fd, path);
+  close(fd);
+  free(path);
+}
+
+//.slurp: the same for the stdin
+S void nslurp() {mload(0, "stdin");}
+
+//P E D .rec: pushes the offset of the first byte D in [P, E), or E,
+//so the record is [P, Q) and the next one starts at Q+1
+S void nrec() {
+  T d = pop, e = pop, p = pop;
+  MCHK(p, e-p);
+  char *q = memchr(mem+p, d, e-p);
+  T r = q ? q-mem : e;
+  push(r);
+}
+
+S void nmemo();
+
+enum { SI_TOP, SI_SAY, SI_HLT, SI_FLS, SI_EVL, SI_ENT, SI_LAF,
+       SI_VSUM, SI_VMIN, SI_VMAX, SI_VFILL, SI_VREV, SI_VROT, SI_VLEN,
+       SI_VCPY, SI_LD, SI_ST, SI_LDB, SI_STB, SI_MCPY, SI_MFILL, SI_MSIZE,
+       SI_MGROW, SI_MFILE, SI_SLURP, SI_REC, SI_MEMO };
+
+S struct { char *name; void (*f)(); } natives[] = {
+  [SI_TOP] = {"top", ntop},
+  [SI_SAY] = {"say", nsay},
+  [SI_HLT] = {"hlt", nhlt},
+  [SI_FLS] = {"flush", obflush},
+  [SI_EVL] = {"eval", evl},
+  [SI_ENT] = {"_entry"},
+  [SI_LAF] = {"#laff", nlaff}, //can't be typed, the optimizer emits it
+  [SI_VSUM] = {"vsum", nvsum},
+  [SI_VMIN] = {"vmin", nvmin},
+  [SI_VMAX] = {"vmax", nvmax},
+  [SI_VFILL] = {"vfill", nvfill},
+  [SI_VREV] = {"vrev", nvrev},
+  [SI_VROT] = {"vrot", nvrot},
+  [SI_VLEN] = {"vlen", nvlen},
+  [SI_VCPY] = {"vcpy", nvcpy},
+  [SI_LD] = {"ld", nld},
+  [SI_ST] = {"st", nst},
+  [SI_LDB] = {"ldb", nldb},
+  [SI_STB] = {"stb", nstb},
+  [SI_MCPY] = {"mcpy", nmcpy},
+  [SI_MFILL] = {"mfill", nmfill},
+  [SI_MSIZE] = {"msize", nmsize},
+  [SI_MGROW] = {"mgrow", nmgrow},
+  [SI_MFILE] = {"mfile", nmfile},
+  [SI_SLURP] = {"slurp", nslurp},
+  [SI_REC] = {"rec", nrec},
+  [SI_MEMO] = {"memo", nmemo},
+};
+
+#define NNAT (int)(sizeof(natives)/sizeof(natives[0]))
+
+S void swi(T id) {
+  if (id < 0 || id >= NNAT || !natives[id].f) fail(E_CALL, "Bad function `%d`\n", id);
+  natives[id].f();
 }
 
+/* Tiering (-H): the functions start in the interpreter, counting their
+   calls in run() and their back jumps in LJ and #loop. After HOTN of
+   either, tierup() passes the body through the optimizer into new heap
+   code, and fn[] points there. A frame looping in the old body moves
+   over at its next back jump (on-stack replacement). The optimizer keeps
+   the control flow opcodes, with the same stack and A at each, and
+   copies the code it can't improve as is, so it records these spans,
+   mapping the positions a frame can be at between the two bodies.
+   There is no native tier, the optimized code is bytecode too.
+
+   The optimized code may inline the small functions it calls, so each
+   function has a version, bumped by its redefinitions, and the tiered
+   code keeps the versions of those it inlined. A redefinition of one
+   of them deoptimizes it: fn[] gets the baseline body back and the
+   frames running the optimized one, the current included, move back
+   through the spans. It then tiers up again with the new definition,
+   unless it got deoptimized MAXDEOPT times already.
+*/
+#define HOTN 1000
+#define MAXDEOPT 8
+
+typedef struct { P b, o, n; } Span;
+typedef struct Memo Memo; //n nibbles at b in the baseline, at o
+
+typedef struct {
+  P bs, be, os, oe; //the baseline and the optimized bodies
+  Span *sp;
+  int nsp;
+  T *dep;       //the functions inlined
+  uint32_t *dv; //and their versions
+  int nd;
+} Tier;
+
+S struct {
+  uint32_t n, b; //calls, back jumps
+  uint32_t v;    //version
+  uint32_t d;    //deoptimizations
+  int t;         //tiered, or not worth it
+  int used;      //inlined by that many tiered functions
+  Tier *tr;
+  Memo *mt;      //results of the runs, for id.memo
+} hot[MAXFN];
+S int hotc; //counting, for -H or -p
+S T cur = -1; //the function running, -1 in the blocks
+S int mstale; //a memoized function may have lost its definition
+
+S void tierup(T id);
+S void osr();
+S void redef(T id);
+S int mget(Memo *m);
+S void mput(Memo *m);
+S void mcheck();
+
+#define HOTJ() do { \
+  if (hotc && cur >= 0 && ++hot[cur].b >= HOTN && !hot[cur].t) osr(); \
+} while(0)
+
 S P dfn_close() {
   for (; ip<end; ip++) {
     if (pk == C_DFN) return ++ip;
-    if (pk == C_BCD) for (; ip<end && pk != BCD_N && pk != BCD_P; ip++);
+    if (pk == C_BCD) {
+      if (ip+1 < end && nib(code, ip+1) > 11) ip += 2; //extension
+      else for (; ip<end && pk != BCD_N && pk != BCD_P; ip++);
+    }
   }
-  printf("Couldn't match `:`\n");
-  exit(-1);
+  fail(E_CODE, "Couldn't match `:`\n");
+}
+
+//the image's extents are sorted by start, so we can skip the scan
+S P fx_close() {
+  int l = 0, h = nfx;
+  while (l < h) {
+    int m = (l+h)/2;
+    if (fx[m].start < ip) l = m+1;
+    else h = m;
+  }
+  if (l < nfx && fx[l].start == ip) return ip = fx[l].end+1;
+  return dfn_close();
 }
 
 S void dfn(T id) {
-  fn[id].start = ip;
-  fn[id].end = dfn_close()-1;
+  if (id < 0 || id >= MAXFN) fail(E_CALL, "Bad function `%d`\n", id);
+  P s = ip, e = fx_close()-1;
+  redef(id);
+  fn[id].start = s;
+  fn[id].end = e;
 }
 
 S void run(T id) {
+  if (id < 0 || id >= MAXFN) fail(E_CALL, "Bad function `%d`\n", id);
   if (!fn[id].end) {
     swi(id);
     return;
   }
+  int mm = 0;
+  if (hot[id].mt) {
+    if (mstale) mcheck();
+    if (hot[id].mt && (mm = mget(hot[id].mt)) < 0) return;
+  }
+  if (hotc && ++hot[id].n >= HOTN && !hot[id].t) tierup(id);
+  fr[fp].mm = mm;
+  fr[fp].id = cur;
   fr[fp].ra = ra;
+  fr[fp].lsp = lsp;
   fr[fp].ip = ip;
   fr[fp].start = start;
   fr[fp++].end = end;
@@ -217,6 +899,7 @@ S void run(T id) {
   end = fn[id].end;
   ip = start;
   ra = 0;
+  cur = id;
 }
 
 S void rw(T index) {
@@ -227,25 +910,108 @@ S void rw(T index) {
   }
 }
 
+//the targets are cached by the position of the bracket itself,
+//so the brackets around a single nibble body get separate entries
 S void jmp(C open, C close, P inc, P end) {
-  P target = jtbl[ip];
+  P sip = inc > 0 ? ip-1 : ip+1;
+  P target = jtbl[sip];
   if (target!=BADIP) {
     ip = target;
     return;
   }
-  int sip = ip;
   int depth = 0;
-  for (; ip!=end; ip+=inc) {
-    if (pk == open) depth++;
-    else if (pk == close) {
+  for (; inc > 0 ? ip < end : ip >= end; ip+=inc) {
+    C c = pk;
+    if (inc > 0 && !c && ip+1 < end && nib(code, ip+1) > 11) { //extension
+      ip += 2;
+      continue;
+    }
+    if (inc < 0 && c > 11 && ip > end && !nib(code, ip-1)) {
+      ip--;
+      continue;
+    }
+    if (c == open) depth++;
+    else if (c == close) {
       if(!depth) {
         jtbl[sip] = ++ip;
         return;
       } depth--;
     }
   }
-  printf("Couldn't match `%X`\n", open);
-  exit(-1);
+  fail(E_CODE, "Couldn't match `%X`\n", open);
+}
+
+//like jmp, for the extension just read, matching extensions only
+S void xjmp(int open, int close, P inc, P lim) {
+  P sip = ip-3;
+  if (jtbl[sip] != BADIP) {
+    ip = jtbl[sip];
+    return;
+  }
+  int depth = 0;
+  for (P p = inc > 0 ? ip : ip-4; inc > 0 ? p+2 < lim : p >= lim; p += inc) {
+    if (nib(code, p) || nib(code, p+1) < 12) continue;
+    int x = nib(code, p+1)<<4 | nib(code, p+2);
+    if (x == open) depth++;
+    else if (x == close && !depth--) {
+      ip = jtbl[sip] = p+3;
+      return;
+    }
+  }
+  fail(E_CODE, "Couldn't match `%X`\n", open);
+}
+
+//computes the arithmetic extension `x`, 0 on division by zero
+S int xar(int x, T a, T b, T *r) {
+  uint32_t u = a, w = b;
+  switch (x) {
+  case X_DIV: case X_MOD:
+    if (!b) return 0;
+    if (b == -1) *r = x == X_DIV ? -u : 0; //INT_MIN/-1 would trap
+    else *r = x == X_DIV ? a/b : a%b;
+    break;
+  case X_LT: *r = a < b; break;
+  case X_EQ: *r = a == b; break;
+  case X_AND: *r = u & w; break;
+  case X_OR: *r = u | w; break;
+  case X_XOR: *r = u ^ w; break;
+  case X_SHL: *r = u << (w&31); break;
+  case X_SHR: *r = u >> (w&31); break;
+  }
+  return 1;
+}
+
+S void xop(int x) {
+  switch (x) {
+  case X_DIV: case X_MOD: case X_LT: case X_EQ: case X_AND:
+  case X_OR: case X_XOR: case X_SHL: case X_SHR: {
+    T a = pop, b = pop, r;
+    if (!xar(x, a, b, &r)) fail(E_ARITH, "Division by zero\n");
+    push(r);
+    break;
+    }
+  case X_DO: {
+    T n = pop;
+    if (n <= 0) xjmp(X_DO, X_LOOP, 1, end);
+    else {
+      if (lsp == MAXLS) fail(E_RANGE, "Loop stack overflow\n");
+      ls[lsp].i = 0;
+      ls[lsp++].n = n;
+    }
+    break;
+    }
+  case X_LOOP:
+    if (lsp <= fr[fp-1].lsp) fail(E_RANGE, "`#loop` without `#do`\n");
+    if (++ls[lsp-1].i < ls[lsp-1].n) {
+      xjmp(X_LOOP, X_DO, -1, start);
+      HOTJ();
+    } else lsp--;
+    break;
+  case X_I: push(lsp > 0 ? ls[lsp-1].i : 0); break;
+  case X_J: push(lsp > 1 ? ls[lsp-2].i : 0); break;
+  default:
+    fail(E_CODE, "Bad extension `%X`\n", x);
+  }
 }
 
 #define LJ(open,close,r)  do { \
@@ -253,6 +1019,7 @@ S void jmp(C open, C close, P inc, P end) {
     --r; \
     ip-=2; \
     jmp(open, close, -1, start); \
+    HOTJ(); \
   } \
 } while(0)
 
@@ -278,70 +1045,401 @@ S void exe() {
 }
 
 
-#define emit(c) do {if (ip&1) q[ip++/2]|=(c)<<4; else q[ip++/2]=(c);} while(0)
+/* Assembler.
+   The source comes either from memory (a string or a mapped file) or from
+   a file descriptor read in ASMCHUNK pieces. The nibbles are emitted into
+   a buffer, growing with the output, so the memory stays proportional
+   to the code size.
+*/
+#define ASMCHUNK (64*1024)
 
-S T sym(char *name) {
-  for (int i = 0; i < np; i++) if (!strcmp(nm[i],name)) return i;
-  if (np == MAXNP) {
-    printf("Name table overflow.\n");
-    exit(-1);
+typedef struct { char *s; T v; } Lsym;
+
+typedef struct {
+  C *q;        //emitted code
+  P ip;        //nibbles emitted
+  size_t cap;  //bytes allocated for q
+  char *p, *e; //current input window
+  int fd;      //source of the next window or -1
+  char *buf;   //window storage for fd reads
+  P *sr;       //symbol reference sites: where the name ids were emitted
+  int nsr, srcap;
+  int dyn;     //depends on the VM state: used macros, intern or a block
+  int loc;     //a piece of a parallel assembly, keeping its new names apart
+  Lsym *lt;    //the names it looked up
+  uint32_t ltcap, nlt;
+  char **ln;   //its new names, the i-th emitted as MAXNP+i
+  int nln;
+  char name[MAXNM];
+} Asm;
+
+S void agrow(Asm *a) {
+  a->cap = a->cap ? a->cap*2 : 256;
+  a->q = realloc(a->q, a->cap);
+}
+
+#define emit(c) do { \
+  if (a->ip/2 >= (P)a->cap) agrow(a); \
+  if (a->ip&1) a->q[a->ip++/2] |= (c)<<4; else a->q[a->ip++/2] = (c); \
+} while(0)
+
+S void asite(Asm *a, P at) {
+  if (a->nsr == a->srcap)
+    a->sr = realloc(a->sr, (a->srcap = a->srcap ? a->srcap*2 : 64)*sizeof(P));
+  a->sr[a->nsr++] = at;
+}
+
+S int afill(Asm *a) {
+  if (a->fd < 0) return 0;
+  ssize_t n = read(a->fd, a->buf, ASMCHUNK);
+  if (n <= 0) return 0;
+  a->p = a->buf;
+  a->e = a->buf + n;
+  return 1;
+}
+
+//next input char or EOF
+#define ain(a) ((a)->p < (a)->e || afill(a) ? (uint8_t)*(a)->p++ : EOF)
+#define apk(a) ((a)->p < (a)->e || afill(a) ? (uint8_t)*(a)->p : EOF)
+
+//name table index: open addressing hash of id+1
+//locked, since the parallel assembler interns from several threads
+S uint32_t *nh;
+S uint32_t nhcap;
+S pthread_mutex_t nmlock = PTHREAD_MUTEX_INITIALIZER;
+
+S uint32_t strhash(char *s) {
+  uint32_t h = 2166136261u;
+  for (; *s; s++) h = (h ^ (uint8_t)*s) * 16777619u;
+  return h;
+}
+
+//interns the name, with nmlock held, returning -1 when the table is full
+//or, unless `add`, when it isn't there
+S T isym(char *name, int add) {
+  if (np*2 >= (int)nhcap) {
+    free(nh);
+    nhcap = nhcap ? nhcap*2 : 1024;
+    nh = calloc(nhcap, sizeof(*nh));
+    for (int i = 0; i < np; i++) {
+      uint32_t h = strhash(nm[i]);
+      while (nh[h&(nhcap-1)]) h++;
+      nh[h&(nhcap-1)] = i+1;
+    }
+  }
+  uint32_t h = strhash(name);
+  for (; nh[h&(nhcap-1)]; h++) {
+    T i = nh[h&(nhcap-1)]-1;
+    if (!strcmp(nm[i],name)) return i;
   }
+  if (!add || np == MAXNP) return -1;
   nm[np] = strdup(name);
+  nh[h&(nhcap-1)] = np+1;
   return np++;
 }
 
-S P emitBCD(uint8_t *q ,P ip, int v) {
-  char *n = name;
+S T sym(char *name) {
+  pthread_mutex_lock(&nmlock);
+  T i = isym(name, 1);
+  pthread_mutex_unlock(&nmlock);
+  if (i < 0) fail(E_LIMIT, "Name table overflow.\n");
+  return i;
+}
+
+//the id of the name, or in a piece of a parallel assembly, the global id
+//if it has one by now, else MAXNP+i for its i-th new name, so the
+//ids are given in the source order once the pieces are joined
+S T asym(Asm *a, char *name) {
+  if (!a->loc) return sym(name);
+  if (a->nlt*2 >= a->ltcap) {
+    Lsym *o = a->lt;
+    uint32_t oc = a->ltcap;
+    a->ltcap = oc ? oc*2 : 1024;
+    a->lt = calloc(a->ltcap, sizeof(Lsym));
+    for (uint32_t i = 0; i < oc; i++) if (o[i].s) {
+      uint32_t h = strhash(o[i].s);
+      while (a->lt[h&(a->ltcap-1)].s) h++;
+      a->lt[h&(a->ltcap-1)] = o[i];
+    }
+    free(o);
+  }
+  uint32_t h = strhash(name);
+  for (; a->lt[h&(a->ltcap-1)].s; h++)
+    if (!strcmp(a->lt[h&(a->ltcap-1)].s, name)) return a->lt[h&(a->ltcap-1)].v;
+  pthread_mutex_lock(&nmlock);
+  T v = isym(name, 0);
+  pthread_mutex_unlock(&nmlock);
+  char *t = strdup(name);
+  if (v < 0) {
+    if (!(a->nln & (a->nln-1))) a->ln = realloc(a->ln, (a->nln ? a->nln*2 : 1)*sizeof(char*));
+    v = MAXNP + a->nln;
+    a->ln[a->nln++] = t;
+  }
+  a->lt[h&(a->ltcap-1)] = (Lsym){t, v};
+  a->nlt++;
+  return v;
+}
+
+S void emitBCD(Asm *a, uint32_t v) {
+  char d[10], *n = d;
   do { *n++ = v%10; v /= 10; } while (v);
   int b = *--n;
   emit(C_BCD);
   if (b>1) emit(b);
-  while (n > name) emit(*--n);
+  while (n > d) emit(*--n);
   emit(b==1 ? 11 : 10);
-  return ip;
 }
 
-S char *b4asmS(uint8_t *q, P ip, char *p, char *end, P *oip) {
+//negative values are encoded as `-v 0-`
+S void emitT(Asm *a, T v) {
+  if (v >= 0) emitBCD(a, v);
+  else {
+    emitBCD(a, -(uint32_t)v);
+    emitBCD(a, 0);
+    emit(C_SUB);
+  }
+}
+
+/* Macro stage.
+     {code}           ; assembled and ran at assembly time, the values
+                      ; it leaves on the stack are spliced in as literals
+     Name(A B){body}  ; defines a macro with parameters A and B
+     Name(x y)        ; expands into body, with A and B replaced by x and y
+     intern(a b c)    ; interns the names, without emitting their ids
+   Definitions made inside `{}` exist only in the assembling VM.
+*/
+#define MAXMP 16  //macro parameters
+#define MAXMD 64  //macro expansion depth
+
+typedef struct {
+  char *name;
+  int n;
+  char *par[MAXMP];
+  char *body;
+} Mac;
+
+S Mac *mac;
+S int nmac;
+S int mdepth;
+
+S void b4asmS(Asm *a);
+S P hput(C *q, P n);
+S void nest(P s, P e);
+
+//reads the text up to the `close` matching the already read opener
+S char *agrab(Asm *a, int open, int close) {
+  size_t n = 0, cap = 64;
+  char *t = malloc(cap);
+  int c, depth = 0, quote = 0;
+  for (;;) {
+    if ((c = ain(a)) == EOF) fail(E_ASM, "Unterminated `%c`\n", open);
+    if (quote) {
+      if (c == '\'') quote = 0;
+      else if (c == '\\') {
+        t[n++] = c;
+        if ((c = ain(a)) == EOF) fail(E_ASM, "Unterminated quote\n");
+      }
+    } else if (c == '\'') quote = 1;
+    else if (c == open) depth++;
+    else if (c == close && !depth--) break;
+    t[n++] = c;
+    if (n+2 >= cap) t = realloc(t, cap *= 2);
+  }
+  t[n] = 0;
+  return t;
+}
+
+//assembles the text inline, into a's output
+S void asub(Asm *a, char *text) {
+  if (mdepth == MAXMD) fail(E_ASM, "Macro expansion is too deep\n");
+  Asm b = *a;
+  b.p = text;
+  b.e = text + strlen(text);
+  b.fd = -1;
+  b.buf = 0;
+  mdepth++;
+  b4asmS(&b);
+  mdepth--;
+  a->q = b.q;
+  a->ip = b.ip;
+  a->cap = b.cap;
+  a->sr = b.sr;
+  a->nsr = b.nsr;
+  a->srcap = b.srcap;
+  a->dyn = b.dyn;
+}
+
+//splits macro arguments at whitespace outside of brackets and quotes
+S int asplit(char *t, char **v) {
+  int n = 0;
+  for (;;) {
+    while (isspace((uint8_t)*t)) t++;
+    if (!*t) return n;
+    if (n == MAXMP) fail(E_ASM, "Too many macro arguments\n");
+    v[n++] = t;
+    for (int depth = 0, quote = 0; *t; t++) {
+      if (quote) {
+        if (*t == '\\' && t[1]) t++;
+        else if (*t == '\'') quote = 0;
+      } else if (*t == '\'') quote = 1;
+      else if (*t == '(' || *t == '{') depth++;
+      else if (*t == ')' || *t == '}') depth--;
+      else if (isspace((uint8_t)*t) && !depth) break;
+    }
+    if (*t) *t++ = 0;
+  }
+}
+
+//evaluates a `{...}` block, splicing its results in
+S void ablock(Asm *a) {
+  char *t = agrab(a, '{', '}');
+  Asm b = {0};
+  a->dyn = 1;
+  b.p = t;
+  b.e = t + strlen(t);
+  b.fd = -1;
+  mdepth++;
+  b4asmS(&b);
+  mdepth--;
+  free(t);
+  int base = sp;
+  P s = hput(b.q, b.ip);
+  free(b.q);
+  free(b.sr);
+  nest(s, s+b.ip);
+  if (sp < base) fail(E_ASM, "Assembly time block consumed the stack\n");
+  for (int i = base; i < sp; i++) emitT(a, st[i]);
+  sp = base;
+}
+
+S void amacro(Asm *a, char *name) {
+  a->dyn = 1;
+  ain(a); //the `(`
+  char *t = agrab(a, '(', ')'), *v[MAXMP];
+  int n = asplit(t, v);
+  if (!strcmp(name, "intern")) {
+    for (int i = 0; i < n; i++) sym(v[i]);
+    free(t);
+    return;
+  }
+  if (apk(a) == '{') { //definition
+    ain(a);
+    Mac *m = 0;
+    for (int i = 0; i < nmac; i++) if (!strcmp(mac[i].name, name)) m = &mac[i];
+    if (!m) {
+      mac = realloc(mac, (nmac+1)*sizeof(Mac));
+      m = &mac[nmac++];
+      m->name = strdup(name);
+    } else {
+      for (int i = 0; i < m->n; i++) free(m->par[i]);
+      free(m->body);
+    }
+    m->n = n;
+    for (int i = 0; i < n; i++) m->par[i] = strdup(v[i]);
+    m->body = agrab(a, '{', '}');
+    free(t);
+    return;
+  }
+  Mac *m = 0;
+  for (int i = 0; i < nmac; i++) if (!strcmp(mac[i].name, name)) m = &mac[i];
+  if (!m) fail(E_ASM, "Unknown macro `%s`\n", name);
+  if (n != m->n) fail(E_ASM, "Macro `%s` takes %d arguments\n", name, m->n);
+  //substitute the parameters outside of quotes
+  size_t cap = strlen(m->body)+1, k = 0;
+  char *x = malloc(cap), *p = m->body;
+  while (*p) {
+    char *w = p, *r = 0;
+    size_t rn;
+    if (isalpha((uint8_t)*p) || *p == '_') {
+      while (isalnum((uint8_t)*p) || *p == '_') p++;
+      for (int i = 0; i < n; i++)
+        if (strlen(m->par[i]) == (size_t)(p-w) && !memcmp(m->par[i], w, p-w))
+          r = v[i];
+    } else if (*p == '\'') {
+      for (p++; *p && *p != '\''; p++) if (*p == '\\' && p[1]) p++;
+      if (*p) p++;
+    } else p++;
+    if (!r) r = w;
+    rn = r == w ? (size_t)(p-w) : strlen(r);
+    if (k+rn+1 >= cap) x = realloc(x, cap = (k+rn+1)*2);
+    memcpy(x+k, r, rn);
+    k += rn;
+  }
+  x[k] = 0;
+  free(t);
+  asub(a, x);
+  free(x);
+}
+
+S struct { char *name; int code; } xops[] = {
+  {"do", X_DO}, {"loop", X_LOOP}, {"i", X_I}, {"j", X_J},
+  {"div", X_DIV}, {"mod", X_MOD}, {"lt", X_LT}, {"eq", X_EQ},
+  {"and", X_AND}, {"or", X_OR}, {"xor", X_XOR},
+  {"shl", X_SHL}, {"shr", X_SHR},
+};
+
+#define NXOPS (int)(sizeof(xops)/sizeof(xops[0]))
+
+S void emitX(Asm *a, int x) {
+  emit(C_BCD);
+  emit(x>>4);
+  emit(x&0xF);
+}
+
+//assembles `#name` extensions
+S void axop(Asm *a) {
+  char *n = a->name;
+  while (isalpha(apk(a)) && n < a->name+MAXNM-1) *n++ = ain(a);
+  *n = 0;
+  int i = 0;
+  while (i < NXOPS && strcmp(xops[i].name, a->name)) i++;
+  if (i == NXOPS) fail(E_ASM, "Bad extension `#%s`\n", a->name);
+  emitX(a, xops[i].code);
+}
+
+S void b4asmS(Asm *a) {
   int run = 0;
-  while (p < end) {
-    int c = *p++;
+  int c;
+  while ((c = ain(a)) != EOF) {
     if (isalpha(c)||c=='_') {
-      char *n = name;
-      char *e = name+MAXNM;
+      char *n = a->name;
+      char *e = a->name+MAXNM;
       *n++ = c;
-      while (isalnum(*p)||*p=='_') {
-        *n++ = *p++;
+      while (isalnum(apk(a))||apk(a)=='_') {
+        *n++ = ain(a);
         if (n == e) {
           n[-1] = 0;
-          printf("Name is too long: %s...\n", name);
-          exit(-1);
+          fail(E_ASM, "Name is too long: %s...\n", a->name);
         }
       }
       *n = 0;
-      ip = emitBCD(q, ip, sym(name));
+      if (apk(a) == '(') {
+        amacro(a, a->name);
+        if (run) { emit(C_RUN); run = 0; }
+        continue;
+      }
+      asite(a, a->ip);
+      emitBCD(a, asym(a, a->name));
       if (run) { emit(C_RUN); run = 0; }
       continue;
     }
     switch(c) {
     case '\'': {
-      ip = emitBCD(q, ip, 0);
-      while (p<end && *p != '\'') {
-        if (*p == '\\') p++;
-        ip = emitBCD(q, ip, *p++);
-      }
-      if (p++ == end) {
-        printf("Unterminated quote\n");
-        exit(-1);
+      emitBCD(a, 0);
+      while ((c = ain(a)) != '\'') {
+        if (c == '\\') c = ain(a);
+        if (c == EOF) fail(E_ASM, "Unterminated quote\n");
+        emitBCD(a, c);
       }
       break;
     }
-    case ' ': case '\n': break; //nop
+    case ' ': case '\n': case '\t': case '\r': break; //nop
     case '0': case '1': case '2': case '3': case '4':
     case '5': case '6': case '7': case '8': case '9':
       int b = c-'0';
       emit(C_BCD);
       if (b>1) emit(b);
-      while (isdigit(*p)) emit(*p++-'0');
+      while (isdigit(apk(a))) emit(ain(a)-'0');
       emit(b==1 ? 11 : 10);
       break;
     case '+': emit(C_ADD); break;
@@ -352,7 +1450,7 @@ S char *b4asmS(uint8_t *q, P ip, char *p, char *end, P *oip) {
     case '<': emit(C_JBO); break;
     case '>': emit(C_JBC); break;
     case ':': emit(C_DFN); break;
-    case '.': if (isalpha(*p)||*p=='_') run = 1; else emit(C_RUN); break;
+    case '.': if (isalpha(apk(a))||apk(a)=='_') run = 1; else emit(C_RUN); break;
     case '@': emit(C_RET); break;
     case '$': emit(C_RWS); break;
     case '!': emit(C_POP); break;
@@ -360,88 +1458,2289 @@ S char *b4asmS(uint8_t *q, P ip, char *p, char *end, P *oip) {
     case '=': emit(C_RDA); break;
     case '?': emit(C_STA); break;
     case '%': emit(C_BCD); emit(10); emit(C_RWS); break;
+    case '{': ablock(a); break;
+    case '#': axop(a); break;
+    case '/': emitX(a, X_DIV); break;
+    case '&': emitX(a, X_AND); break;
+    case '|': emitX(a, X_OR); break;
+    case '^': emitX(a, X_XOR); break;
     default:
-      printf("Bad opcode `%c`\n", c);
-      exit(-1);
+      fail(E_ASM, "Bad opcode `%c`\n", c);
     }
   }
-  *oip = ip;
-  return p;
-}
-
-uint8_t *b4asm(P *osize, char *statement) {
-  char *p = statement;
-  P insz = strlen(p);
-  char *end = p + strlen(p);
-  uint8_t *q = malloc(insz*2+100); //mul by 2 since 7 becomes #7n
-  P ip = 0;
-  b4asmS(q, ip, p, end, &ip);
-  *osize = ip;
-  P sz = (ip+1)/2;
-  uint8_t *r = malloc(sz);
-  memcpy(r, q, sz);
-  free(q);
-  return r;
 }
 
-S int ready;
+/* Parallel assembly.
+   b4 code needs no relocation, so a source split at the top level
+   definitions can be assembled in pieces, which are then concatenated.
+   The pieces ending at an odd nibble shift the following piece by 4 bits.
+   The names new to a piece get interned in the piece order after the
+   threads are joined, so the ids and the code match a serial assembly.
+*/
+#define MAXJOBS 64
+#define PARMIN (256*1024) //smaller sources aren't worth the threads
 
+S int jobs = 1;
 
-S int init() {
-  sym("top");
-  sym("say");
-  sym("hlt");
-  sym("_entry");
-  ready = 1;
-}
+S P dec(C *q, P p, P e, int *op, T *v);
 
-S void frloop() {
-  for (;;) {
-    exe();
-    if (!--fp) return;
-    ip = fr[fp].ip;
-    start = fr[fp].start;
-    end = fr[fp].end;
-    ra = fr[fp].ra;
+//appends b's output to a's, giving its new names the ids in `gid`
+S void acat(Asm *a, Asm *b, T *gid) {
+  C *q = b->q;
+  P n = b->ip;
+  if (b->nln) {
+    int si = 0, op;
+    T v;
+    for (P p = 0; p < n; ) {
+      if (si < b->nsr && b->sr[si] == p) {
+        p = dec(q, p, n, &op, &v);
+        asite(a, a->ip);
+        emitBCD(a, v >= MAXNP ? gid[v-MAXNP] : v);
+        si++;
+      } else {
+        emit(nib(q, p));
+        p++;
+      }
+    }
+    return;
   }
+  for (int i = 0; i < b->nsr; i++) asite(a, a->ip + b->sr[i]);
+  while ((size_t)(a->ip + n)/2 + 1 >= a->cap) agrow(a);
+  C *d = a->q + a->ip/2;
+  if (a->ip&1) {
+    for (P i = 0; i < (n+1)/2; i++) {
+      d[i] |= q[i]<<4;
+      d[i+1] = q[i]>>4;
+    }
+  } else memcpy(d, q, (n+1)/2);
+  a->ip += n;
 }
 
-void b4cmd(char *command) {
-  P csz;
-  if (!ready) init();
-
-  code = b4asm(&csz, command);
-
-  printf("Code size: %d bytes\n", (csz+1)/2);
+typedef struct { Asm *a; B4Err *e; } Aj;
 
-  jtbl = malloc(csz*sizeof(P));
-  
-  for (int i = 0; i < csz; i++) jtbl[i] = BADIP;
+//assembles a piece, recording a failure rather than raising it,
+//so all the threads get joined
+S void *ajob(void *arg) {
+  Aj *j = arg;
+  jmp_buf jb, *o = onfail;
+  onfail = &jb;
+  if (setjmp(jb)) *j->e = err;
+  else b4asmS(j->a);
+  onfail = o;
+  return 0;
+}
 
-  int entry = sym("_entry");
-  fn[entry].start = 0;
-  fn[entry].end = csz;
-  run(entry);
+//assembles the in memory window of `a` using up to `jobs` threads
+S void b4asmP(Asm *a) {
+  char *p = a->p, *e = a->e, *cut[MAXJOBS+1];
+  int n = jobs < MAXJOBS ? jobs : MAXJOBS;
+  size_t step = (e-p)/n;
+  int nc = 0, quote = 0, dfn = 0;
+  cut[nc++] = p;
+  if (n > 1 && (size_t)(e-p) >= PARMIN) {
+    char *next = p+step;
+    for (char *s = p; s < e; s++) {
+      if (quote) {
+        if (*s == '\\') s++;
+        else if (*s == '\'') quote = 0;
+      } else if (*s == '\'') quote = 1;
+      else if (*s == '(' || *s == '{') { //macros must see the whole source
+        nc = 1;
+        break;
+      } else if (*s == ':' && !(dfn ^= 1) && s+1 >= next && nc < n) {
+        cut[nc++] = s+1;
+        next = s+1+step;
+      }
+    }
+  }
+  cut[nc] = e;
+  if (nc == 1) {
+    b4asmS(a);
+    return;
+  }
+  Asm *j = calloc(nc, sizeof(Asm));
+  B4Err *je = calloc(nc, sizeof(B4Err));
+  Aj aj[MAXJOBS];
+  pthread_t t[MAXJOBS];
+  char th[MAXJOBS] = {0}; //running in a thread
+  for (int i = 0; i < nc; i++) {
+    j[i].p = cut[i];
+    j[i].e = cut[i+1];
+    j[i].fd = -1;
+    j[i].loc = 1;
+    aj[i].a = &j[i];
+    aj[i].e = &je[i];
+    if (i) th[i] = !pthread_create(&t[i], 0, ajob, &aj[i]);
+  }
+  int bad = -1;
+  for (int i = 0; i < nc; i++) {
+    if (th[i]) pthread_join(t[i], 0);
+    else ajob(&aj[i]);
+    if (je[i].kind && bad < 0) bad = i;
+  }
+  T *gid = 0;
+  for (int i = 0; i < nc; i++) {
+    if (bad < 0) {
+      gid = realloc(gid, (j[i].nln+1)*sizeof(T));
+      for (int l = 0; l < j[i].nln; l++) {
+        pthread_mutex_lock(&nmlock);
+        gid[l] = isym(j[i].ln[l], 1);
+        pthread_mutex_unlock(&nmlock);
+        if (gid[l] < 0) {
+          je[i].kind = E_LIMIT;
+          strcpy(je[i].msg, "Name table overflow.\n");
+          bad = i;
+          break;
+        }
+      }
+      if (bad < 0) acat(a, &j[i], gid);
+    }
+    for (uint32_t l = 0; l < j[i].ltcap; l++) free(j[i].lt[l].s);
+    free(j[i].lt);
+    free(j[i].ln);
+    free(j[i].q);
+    free(j[i].sr);
+  }
+  free(gid);
+  free(j);
+  if (bad >= 0) {
+    B4Err e = je[bad];
+    free(je);
+    fail(e.kind, "%s", e.msg);
+  }
+  free(je);
+}
+
+S C *asmdone(Asm *a, P *osize) {
+  *osize = a->ip;
+  free(a->buf);
+  return a->ip ? realloc(a->q, (a->ip+1)/2) : a->q;
+}
+
+S void asmstr(Asm *a, char *statement) {
+  memset(a, 0, sizeof(*a));
+  a->p = statement;
+  a->e = statement + strlen(statement);
+  a->fd = -1;
+  b4asmP(a);
+}
+
+//assembles a file, mapping it when possible, or reading it in chunks
+S void asmfile(Asm *a, char *path) {
+  struct stat s;
+  void *map = MAP_FAILED;
+  memset(a, 0, sizeof(*a));
+  a->fd = strcmp(path, "-") ? open(path, O_RDONLY) : 0;
+  if (a->fd < 0 || fstat(a->fd, &s)) fail(E_IO, "Can't open `%s`\n", path);
+  if (S_ISREG(s.st_mode) && s.st_size > 0)
+    map = mmap(0, s.st_size, PROT_READ, MAP_PRIVATE, a->fd, 0);
+  if (map != MAP_FAILED) {
+    madvise(map, s.st_size, MADV_SEQUENTIAL);
+    a->p = map;
+    a->e = a->p + s.st_size;
+    if (a->fd) close(a->fd);
+    a->fd = -1;
+    b4asmP(a);
+  } else {
+    a->buf = malloc(ASMCHUNK);
+    b4asmS(a);
+  }
+  if (map != MAP_FAILED) munmap(map, s.st_size);
+  else if (a->fd) close(a->fd);
+}
+
+uint8_t *b4asm(P *osize, char *statement) {
+  Asm a;
+  asmstr(&a, statement);
+  free(a.sr);
+  return asmdone(&a, osize);
+}
+
+uint8_t *b4asmf(P *osize, char *path) {
+  Asm a;
+  asmfile(&a, path);
+  free(a.sr);
+  return asmdone(&a, osize);
+}
+
+S int ready;
+
+
+S int init() {
+  for (int i = 0; i < NNAT; i++) sym(natives[i].name);
+  npre = np;
+  atexit(obflush);
+  ready = 1;
+}
+
+//decodes the instruction at `p`, returning the position after it
+//for literals `v` gets the value
+S P dec(C *q, P p, P e, int *op, T *v) {
+  *op = nib(q, p);
+  if (*op != C_BCD) return p+1;
+  p++;
+  if (p+1 < e && nib(q, p) > 11) {
+    *op = C_EXT;
+    *v = nib(q, p)<<4 | nib(q, p+1);
+    return p+2;
+  }
+  T n = 0, b = 1;
+  while (p < e) {
+    C c = nib(q, p);
+    p++;
+    if (c == BCD_N || c == BCD_P) {
+      *v = n + b*(c==BCD_P);
+      return p;
+    }
+    n = n*10 + c;
+    b *= 10;
+  }
+  *v = n;
+  return p;
+}
+
+S int nfdyn; //definitions with a computed id or no end, seen by fscan()
+
+//finds the top level `id:...:` definitions with a literal id
+//`def` is where the id literal starts
+//every `:` pair is a definition, so one with a computed id gets skipped too
+S int fscan(C *q, P n, Fx **ofx) {
+  int op, lop = -1, k = 0;
+  T v, pv = 0;
+  P lp = 0;
+  Fx *x = 0;
+  nfdyn = 0;
+  for (P p = 0; p < n; ) {
+    P at = p;
+    p = dec(q, p, n, &op, &v);
+    if (op == C_DFN) {
+      P s = p;
+      int lit = lop == C_BCD;
+      while (p < n && (p = dec(q, p, n, &op, &v), op != C_DFN));
+      if (op != C_DFN) {
+        nfdyn++;
+        break;
+      }
+      op = -1;
+      if (!lit) {
+        nfdyn++;
+        lop = op;
+        continue;
+      }
+      x = realloc(x, (k+1)*sizeof(*x));
+      x[k].id = pv;
+      x[k].def = lp;
+      x[k].start = s;
+      x[k++].end = p-1;
+    }
+    lop = op;
+    pv = v;
+    lp = at;
+  }
+  *ofx = x;
+  return k;
+}
+
+/* Tree shaking.
+   Top level definitions no call can reach are stripped. The code outside
+   of the definitions is live, and so are the definitions of the ids it
+   calls as `id.` or mentions as literals, since these might be called
+   later. A call of a computed id (`.` without a literal before it) can
+   reach anything, so SHAKE_SAFE keeps everything when one is live,
+   while SHAKE_ALL assumes computed ids are always mentioned somewhere.
+*/
+enum { SHAKE_NONE, SHAKE_SAFE, SHAKE_ALL };
+
+S int shake;
+
+S void anib(Asm *a, C c) {emit(c);}
+
+S Fx *sfx; //for sorting
+S int fxcmp(const void *a, const void *b) {
+  T x = sfx[*(int*)a].id, y = sfx[*(int*)b].id;
+  return x < y ? -1 : x > y;
+}
+
+S void aswap(Asm *a, Asm *o);
+
+S void ashake(Asm *a) {
+  Fx *x;
+  int k = fscan(a->q, a->ip, &x), nw = 0, computed = 0;
+  if (!k) return;
+  char *live = calloc(k, 1);
+  int *work = malloc(k*sizeof(int)), *byid = malloc(k*sizeof(int));
+  for (int i = 0; i < k; i++) byid[i] = i;
+  sfx = x;
+  qsort(byid, k, sizeof(int), fxcmp);
+  //the top level code first, then the bodies of the live definitions
+  for (int w = -1; w < nw; w++) {
+    P s = w < 0 ? 0 : x[work[w]].start, e = w < 0 ? a->ip : x[work[w]].end;
+    int d = 0, op, lop = -1;
+    T v;
+    for (P p = s; p < e; ) {
+      if (w < 0 && d < k && p == x[d].def) {
+        p = x[d++].end+1;
+        lop = -1;
+        continue;
+      }
+      p = dec(a->q, p, e, &op, &v);
+      if (op == C_RUN && lop != C_BCD) computed = 1;
+      if (op == C_BCD) {
+        int l = 0, h = k;
+        while (l < h) {
+          int m = (l+h)/2;
+          if (x[byid[m]].id < v) l = m+1;
+          else h = m;
+        }
+        for (; l < k && x[byid[l]].id == v; l++) if (!live[byid[l]]) {
+          live[byid[l]] = 1;
+          work[nw++] = byid[l];
+        }
+      }
+      lop = op;
+    }
+  }
+  if (computed && shake == SHAKE_SAFE) memset(live, 1, k);
+  //copy the live nibbles and sites
+  Asm o = {0};
+  int si = 0;
+  for (P p = 0, d = 0; p < a->ip; ) {
+    if (d < k && p == x[d].def) {
+      if (!live[d]) {
+        while (si < a->nsr && a->sr[si] < x[d].end+1) si++;
+        p = x[d++].end+1;
+        continue;
+      }
+      d++;
+    }
+    if (si < a->nsr && a->sr[si] == p) asite(&o, o.ip), si++;
+    anib(&o, nib(a->q, p));
+    p++;
+  }
+  aswap(a, &o);
+  free(live);
+  free(work);
+  free(byid);
+  free(x);
+}
+
+/* Optimizer (-O).
+   The straight line code between the control flow opcodes is translated
+   into values: the stack becomes a window of value ids, the values found
+   on the stack at the entry being arguments, and A becomes a value id too.
+   Values are hash consed, so the equal expressions share an id (CSE),
+   `$` with a literal index only moves the ids around (copy propagation),
+   operations on literals are folded, and the values nothing keeps are
+   never lowered, which drops the dead stores, including overwritten `=`.
+   The window is lowered back into stack code, replacing the original
+   when it is shorter. There is no native backend: the output is bytecode.
+*/
+enum { V_CON, V_SYM, V_ARG, V_RA, V_ADD, V_SUB, V_MUL, V_XOP }; //V_XOP: k is the code
+
+typedef struct { int op; T k; int x, y; } Val; //k: the literal or arg index
+
+#define MAXV 1024 //values per segment
+#define MAXW 256  //stack window
+
+S Val vv[MAXV];
+S int nv;
+S int win[2*MAXW], wlo, whi; //window, the args get prepended
+S int nargs, vra, ra0;
+enum { OPT_VAL=1, OPT_LOOP=2, OPT_TIER=4 };
+
+S int opt;
+
+S int vcom(int op, T k) { //commutative?
+  return op == V_ADD || op == V_MUL || (op == V_XOP
+    && (k == X_EQ || k == X_AND || k == X_OR || k == X_XOR));
+}
+
+S int val(int op, T k, int x, int y) {
+  if (op >= V_ADD) {
+    if (vcom(op, k) && x > y) {int t = x; x = y; y = t;}
+    Val *a = vv+x, *b = vv+y;
+    if (a->op == V_CON && b->op == V_CON) {
+      uint32_t u = a->k, w = b->k;
+      T r;
+      if (op != V_XOP)
+        return val(V_CON, op==V_ADD ? u+w : op==V_SUB ? u-w : u*w, 0, 0);
+      if (xar(k, a->k, b->k, &r)) return val(V_CON, r, 0, 0);
+    }
+    if (op == V_SUB && b->op == V_CON && !b->k) return x;
+    if ((op == V_ADD || op == V_MUL) && a->op == V_CON) {
+      if (a->k == (op==V_MUL)) return y;
+      if (op == V_MUL && !a->k) return x;
+    }
+  }
+  for (int i = 0; i < nv; i++)
+    if (vv[i].op == op && vv[i].k == k && vv[i].x == x && vv[i].y == y) return i;
+  vv[nv] = (Val){op, k, x, y};
+  return nv++;
+}
+
+/* Inlining, while tiering up: a call of a literal id, whose body is
+   short straight line code, gets interpreted into the caller's values,
+   with A being 0 in the body, as run() has it. The ids inlined are kept,
+   so redefining them deoptimizes the caller.
+*/
+#define INLN 64   //nibbles of the longest body inlined
+#define MAXDEP 64 //functions inlined by one body
+
+S int tiering; //inline and record the spans
+S int idep, ninl; //inlining depth, calls inlined in the segment
+S int inbody; //in a `:` body, which may outlive the tiered code
+S T dep[MAXDEP];
+S int ndep;
+S Span *spn;
+S int nspn, spncap;
+
+S void span(P b, P o, P n) {
+  if (!tiering) return;
+  if (nspn == spncap) {
+    spncap = spncap ? spncap*2 : 64;
+    spn = realloc(spn, spncap*sizeof(Span));
+  }
+  spn[nspn++] = (Span){b, o, n};
+}
+
+S int vop(int op, T v, int site);
+
+S int vinl() {
+  if (!tiering || inbody || idep == 4 || whi == wlo || vv[win[whi-1]].op != V_CON) return 0;
+  T id = vv[win[whi-1]].k;
+  if (id < 0 || id >= np || !fn[id].end || ndep == MAXDEP) return 0;
+  //a tiered callee is inlined from its baseline, so the ids it
+  //inlined itself become dependencies of the caller as well
+  P p = fn[id].start, e = fn[id].end;
+  if (hot[id].tr && p == hot[id].tr->os) {
+    p = hot[id].tr->bs;
+    e = hot[id].tr->be;
+  }
+  if (e-p > INLN) return 0;
+  int snv = nv, slo = wlo, shi = whi, sargs = nargs, sra = vra, sw[2*MAXW];
+  int op, ok = 1;
+  memcpy(sw+wlo, win+wlo, (whi-wlo)*sizeof(int));
+  T v;
+  whi--;
+  vra = val(V_CON, 0, 0, 0);
+  idep++;
+  while (ok && p < e) {
+    p = dec(code, p, e, &op, &v);
+    ok = vop(op, v, 0);
+  }
+  idep--;
+  if (!ok) { //back to the call
+    nv = snv;
+    wlo = slo;
+    whi = shi;
+    nargs = sargs;
+    vra = sra;
+    memcpy(win+wlo, sw+wlo, (whi-wlo)*sizeof(int));
+    return 0;
+  }
+  vra = sra;
+  int i = 0;
+  while (i < ndep && dep[i] != id) i++;
+  if (i == ndep) dep[ndep++] = id;
+  ninl++;
+  return 1;
+}
+
+#define wmat() (win[--wlo] = val(V_ARG, nargs++, 0, 0))
+#define wpush(v) (win[whi++] = (v))
+
+S int wpop() {
+  if (whi == wlo) wmat();
+  return win[--whi];
+}
+
+/* Specialization, while tiering up: a call of a literal id the inliner
+   won't take, with literals right below the id, calls a clone instead:
+   the function's body with the literals put in front, as a new function.
+   The clone gets tiered up at once, folding the literals through its
+   body, the `$` reaching them and the branches they decide included.
+   The clones are shared by the calls with the same literals, up to the
+   SPECMAX nibbles budget. Like an inlined function, the callee becomes
+   a dependency of the caller.
+*/
+#define SPECN 512        //nibbles of the longest body cloned
+#define SPECMAX (64*1024) //nibbles of all the clones
+#define SPECK 4          //literals taken
+#define MAXSPC 1024
+
+S struct {
+  T of, id;   //the function and its clone
+  uint32_t v; //the version of the function cloned
+  int k, made;
+  T c[SPECK];
+} spc[MAXSPC];
+S int nspc;
+S P spbud; //nibbles cloned
+
+S int vspec() {
+  if (!tiering || inbody || whi == wlo || vv[win[whi-1]].op != V_CON) return 0;
+  T of = vv[win[whi-1]].k, c[SPECK];
+  int k = 0, i;
+  if (of < 0 || of >= np || !fn[of].end || hot[of].mt || ndep == MAXDEP) return 0;
+  P n = fn[of].end-fn[of].start;
+  if (hot[of].tr && fn[of].start == hot[of].tr->os) n = hot[of].tr->be-hot[of].tr->bs;
+  while (k < SPECK && whi-2-k >= wlo && vv[win[whi-2-k]].op == V_CON) {
+    c[k] = vv[win[whi-2-k]].k;
+    k++;
+  }
+  if (!k || n > SPECN) return 0;
+  for (i = 0; i < nspc; i++)
+    if (spc[i].of == of && spc[i].v == hot[of].v && spc[i].k == k
+        && !memcmp(spc[i].c, c, k*sizeof(T))) break;
+  if (i == nspc) {
+    char name[32];
+    if (nspc == MAXSPC || spbud+n+k*12 > SPECMAX) return 0;
+    snprintf(name, sizeof(name), "#spec%u", nspc);
+    spc[i].of = of;
+    spc[i].id = sym(name);
+    spc[i].v = hot[of].v;
+    spc[i].k = k;
+    spc[i].made = 0;
+    memcpy(spc[i].c, c, k*sizeof(T));
+    spbud += n+k*12;
+    nspc++;
+  }
+  whi -= k+1;
+  wpush(val(V_CON, spc[i].id, 0, 0));
+  for (k = 0; k < ndep && dep[k] != of; k++);
+  if (k == ndep) dep[ndep++] = of;
+  ninl++; //the call has to be replaced
+  return 0;
+}
+
+//interprets one instruction into values, 0 if it ends the segment
+S int vop(int op, T v, int site) {
+  int x, y;
+  if (nv > MAXV-72 || wlo < 72 || whi > 2*MAXW-2) return 0;
+  switch (op) {
+  case C_BCD: wpush(val(site ? V_SYM : V_CON, v, 0, 0)); break;
+  case C_ADD: case C_SUB: case C_MUL:
+    x = wpop();
+    y = wpop();
+    wpush(val(op-C_ADD+V_ADD, 0, x, y));
+    break;
+  case C_RWS: //only a literal index is static
+    if (whi == wlo || vv[win[whi-1]].op != V_CON) return 0;
+    v = vv[win[--whi]].k;
+    if (v >= 64 || v < -64) {whi++; return 0;}
+    if (v >= 0) {
+      while (whi-wlo <= v) wmat();
+      x = win[whi-1-v];
+      wpush(x);
+    } else {
+      x = wpop();
+      while (whi+v < wlo) wmat();
+      win[whi+v] = x;
+    }
+    break;
+  case C_RDA: vra = wpop(); break;
+  case C_STA: wpush(vra); break;
+  case C_POP: wpop(); break;
+  case C_SWP: x = wpop(); y = wpop(); wpush(x); wpush(y); break;
+  case C_RUN: return vinl() || vspec();
+  case C_EXT:
+    if (v < X_DIV || v > X_SHR) return 0;
+    if ((v == X_DIV || v == X_MOD) && (whi-wlo < 2 //might fail, so it stays
+        || vv[win[whi-2]].op != V_CON || !vv[win[whi-2]].k)) return 0;
+    x = wpop();
+    y = wpop();
+    wpush(val(V_XOP, v, x, y));
+    break;
+  default: return 0;
+  }
+  return 1;
+}
+
+/* Lowering. The args kk..nargs-1 the window leaves in place stay,
+   while the args below kk get consumed: the code has to start by
+   claiming them in order, as they lie on the stack, before pushing
+   anything. The other uses fetch them with `$` while they last.
+*/
+S Asm *lo;
+S int lw[2*MAXW], nl, claim, kk;
+
+S int claimable(int v) {
+  while (vv[v].op >= V_ADD) v = vv[v].y;
+  return vv[v].op == V_ARG && vv[v].k == kk-1-claim;
+}
+
+S void lfetch(int d, int v) {
+  emitBCD(lo, d);
+  anib(lo, C_RWS);
+  lw[nl++] = v;
+}
+
+S int lv(int v) {
+  Val *x = vv+v;
+  Asm *a = lo;
+  if (claim < kk) {
+    if (x->op == V_ARG && x->k == kk-1-claim) {
+      lw[nl++] = v;
+      claim++;
+      return 1;
+    }
+    if (x->op < V_ADD) return 0;
+  } else {
+    if (x->op != V_CON && x->op != V_SYM && x->op != V_RA)
+      for (int i = nl; i-- > 0; ) if (lw[i] == v) {
+        lfetch(nl-1-i, v);
+        return 1;
+      }
+    switch (x->op) {
+    case V_CON: emitT(a, x->k); lw[nl++] = v; return 1;
+    case V_SYM: asite(a, a->ip); emitBCD(a, x->k); lw[nl++] = v; return 1;
+    case V_RA: emit(C_STA); lw[nl++] = v; return 1;
+    case V_ARG:
+      if (x->k < kk) return 0; //consumed already
+      lfetch(nl + x->k-kk, v);
+      return 1;
+    }
+  }
+  //y goes first, so x ends up on top
+  int f = x->y, s = x->x, sw = 0;
+  if (claim < kk && !claimable(f) && claimable(s)) {
+    f = x->x;
+    s = x->y;
+    sw = !vcom(x->op, x->k);
+  }
+  if (!lv(f) || !lv(s) || claim < kk) return 0;
+  if (sw) emit(C_SWP);
+  if (x->op == V_XOP) emitX(a, x->k);
+  else emit(x->op-V_ADD+C_ADD);
+  lw[--nl-1] = v;
+  return 1;
+}
+
+S int lower(Asm *o) {
+  int t = 0, m = whi-wlo;
+  while (t < m && t < nargs && vv[win[wlo+t]].op == V_ARG
+         && vv[win[wlo+t]].k == nargs-1-t) t++;
+  kk = nargs-t;
+  claim = nl = 0;
+  lo = o;
+  for (int i = wlo+t; i < whi; i++) if (!lv(win[i])) return 0;
+  if (claim < kk) return 0;
+  if (vra != ra0) {
+    if (!lv(vra)) return 0;
+    anib(o, C_RDA);
+  }
+  return 1;
+}
+
+//affine coefficients of `v`, times k: literal, arg and A
+S int vaff(int v, uint32_t k, uint32_t *c) {
+  Val *x = vv+v;
+  switch (x->op) {
+  case V_CON: c[0] += k*x->k; return 1;
+  case V_ARG: c[1] += k; return 1;
+  case V_RA: c[2] += k; return 1;
+  case V_ADD: return vaff(x->x, k, c) && vaff(x->y, k, c);
+  case V_SUB: return vaff(x->x, k, c) && vaff(x->y, -k, c);
+  case V_MUL:
+    if (vv[x->x].op == V_CON) return vaff(x->y, k*vv[x->x].k, c);
+    if (vv[x->y].op == V_CON) return vaff(x->x, k*vv[x->y].k, c);
+  }
+  return 0;
+}
+
+/* Loop idioms. A counted loop runs its body with A going down to 0,
+   so a body leaving nothing but A alone is `[0=]`, while a body adding
+   a*A+b to the top value is summed by #laff in closed form.
+   `p` is after the opening bracket. Returns the position after
+   the closing bracket, or 0 when the body is something else.
+*/
+S P lidiom(C *q, P p, P e, int open, P *sr, int nsr, int si, Asm *a) {
+  int op = -1;
+  T v;
+  uint32_t c[3] = {0};
+  nv = nargs = 0;
+  wlo = whi = MAXW;
+  vra = ra0 = val(V_RA, 0, 0, 0);
+  while (p < e) {
+    P np = dec(q, p, e, &op, &v);
+    int site = si < nsr && sr[si] == p;
+    if (!vop(op, v, site)) break;
+    si += site;
+    p = np;
+    op = -1;
+  }
+  int m = whi-wlo;
+  if (op != open+1 || vra != ra0 || m > 1 || nargs != m) return 0;
+  if (m && (!vaff(win[wlo], 1, c) || c[1] != 1)) return 0;
+  emit(open);
+  if (!c[0] && !c[2]) {
+    emitBCD(a, 0);
+    emit(C_RDA);
+  } else {
+    emitT(a, c[2]);
+    emitT(a, c[0]);
+    asite(a, a->ip);
+    emitBCD(a, SI_LAF);
+    emit(C_RUN);
+  }
+  emit(open+1);
+  return p+1;
+}
+
+//copies q[s..e), with the sites from sr[*si] on
+S void acopy(Asm *o, C *q, P s, P e, P *sr, int nsr, int *si) {
+  while (*si < nsr && sr[*si] < s) ++*si;
+  for (P p = s; p < e; p++) {
+    if (*si < nsr && sr[*si] == p) asite(o, o->ip), ++*si;
+    anib(o, nib(q, p));
+  }
+}
+
+//the position after the bracket closing the one before `p`, 0 if none
+//or if the brackets between aren't balanced, like the `]` in `[T 0<]F>`
+S P jclose(C *q, P p, P e, int open) {
+  int d[3] = {0}, op, k;
+  T v;
+  while (p < e) {
+    p = dec(q, p, e, &op, &v);
+    if (op == C_EXT && (v == X_DO || v == X_LOOP)) k = 2, op = v == X_DO ? 0 : 1;
+    else if (op >= C_JAO && op <= C_JBC) k = (op-C_JAO)/2, op = (op-C_JAO)&1;
+    else continue;
+    if (!op) d[k]++;
+    else if (d[k]) d[k]--;
+    else return k == (open-C_JAO)/2 && !d[0] && !d[1] && !d[2] ? p : 0;
+  }
+  return 0;
+}
+
+//optimizes q[s..e) into `o`
+//a bracket with a literal never entering skips its body
+S void bopt(C *q, P s, P e, P *sr, int nsr, Asm *o) {
+  int si = 0, op, body = 0;
+  T v;
+  while (si < nsr && sr[si] < s) si++;
+  for (P p = s; p < e; ) {
+    P b = p;
+    int bsi = si, n = 0;
+    nv = nargs = ninl = 0;
+    inbody = body;
+    wlo = whi = MAXW;
+    vra = ra0 = val(V_RA, 0, 0, 0);
+    while (p < e) {
+      P np = dec(q, p, e, &op, &v), lp;
+      int site = si < nsr && sr[si] == p;
+      Val *t = whi > wlo ? vv+win[whi-1] : 0;
+      if ((op == C_JAO || op == C_JBO) && t && t->op == V_CON
+          && (op == C_JAO ? !t->k : t->k <= 0) && (lp = jclose(q, np, e, op))) {
+        whi--;
+        while (si < nsr && sr[si] < lp) si++;
+        p = lp;
+        n++;
+        ninl++;
+        continue;
+      }
+      if (!vop(op, v, site)) break;
+      si += site;
+      p = np;
+      n++;
+    }
+    if (p > b) {
+      Asm t = {0};
+      if (n > 1 && lower(&t) && (t.ip < p-b || ninl)) acat(o, &t, 0);
+      else {
+        span(b-s, o->ip, p-b);
+        si = bsi;
+        acopy(o, q, b, p, sr, nsr, &si);
+      }
+      free(t.q);
+      free(t.sr);
+    }
+    if (p < e) { //the instruction ending the segment
+      P np = dec(q, p, e, &op, &v), lp, oi = o->ip;
+      if ((opt&OPT_LOOP) && (op == C_JAO || op == C_JBO)
+          && (lp = lidiom(q, np, e, op, sr, nsr, si, o))) {
+        span(p-s, oi, 1);
+        span(lp-s, o->ip, 0);
+        np = lp;
+      } else {
+        body ^= op == C_DFN;
+        span(p-s, o->ip, np-p);
+        acopy(o, q, p, np, sr, nsr, &si);
+      }
+      p = np;
+    }
+  }
+}
+
+//replaces the code of `a` with that of `o`
+S void aswap(Asm *a, Asm *o) {
+  free(a->q);
+  free(a->sr);
+  a->q = o->q;
+  a->ip = o->ip;
+  a->cap = o->cap;
+  a->sr = o->sr;
+  a->nsr = o->nsr;
+  a->srcap = o->srcap;
+}
+
+S void aopt(Asm *a) {
+  Asm o = {0};
+  bopt(a->q, 0, a->ip, a->sr, a->nsr, &o);
+  aswap(a, &o);
+}
+
+S void tierup(T id);
+
+//puts the clone into the heap, the literals and then the body
+//it can't be done while optimizing, since the heap may move
+S void spmake(int i) {
+  T of = spc[i].of;
+  P s = fn[of].start, e = fn[of].end;
+  Asm a = {0};
+  spc[i].made = 1;
+  if (hot[of].v != spc[i].v) return;
+  if (hot[of].tr && s == hot[of].tr->os) {
+    s = hot[of].tr->bs;
+    e = hot[of].tr->be;
+  }
+  for (int j = spc[i].k; j-- > 0; ) emitT(&a, spc[i].c[j]);
+  for (P p = s; p < e; p++) anib(&a, nib(code, p));
+  T id = spc[i].id;
+  fn[id].start = hput(a.q, a.ip);
+  fn[id].end = fn[id].start + a.ip;
+  free(a.q);
+  free(a.sr);
+  tierup(id);
+}
+
+//optimizes the body of `id` into the heap, when that changes it
+//literals are left as they are, the ids need no renumbering at runtime
+S void tierup(T id) {
+  P s = fn[id].start, e = fn[id].end, i = 0;
+  hot[id].t = 1;
+  if (!(opt&OPT_TIER)) return;
+  Asm o = {0};
+  nspn = ndep = 0;
+  tiering = 1;
+  bopt(code, s, e, 0, 0, &o);
+  tiering = 0;
+  if (o.ip == e-s) while (i < o.ip && nib(o.q, i) == nib(code, s+i)) i++;
+  if (i < o.ip || o.ip < e-s) {
+    Tier *r = malloc(sizeof(Tier));
+    r->bs = s;
+    r->be = e;
+    r->os = fn[id].start = hput(o.q, o.ip);
+    r->oe = fn[id].end = r->os + o.ip;
+    r->sp = malloc(nspn*sizeof(Span));
+    memcpy(r->sp, spn, nspn*sizeof(Span));
+    r->nsp = nspn;
+    r->dep = malloc(ndep*sizeof(T));
+    r->dv = malloc(ndep*sizeof(uint32_t));
+    for (int j = 0; j < ndep; j++) {
+      r->dep[j] = dep[j];
+      r->dv[j] = hot[dep[j]].v;
+      hot[dep[j]].used++;
+    }
+    r->nd = ndep;
+    hot[id].tr = r;
+  }
+  free(o.q);
+  free(o.sr);
+  for (int j = 0; j < nspc; j++) if (!spc[j].made) spmake(j);
+}
+
+//maps the position `p` between the bodies, BADIP when no span has it
+S P tmap(Tier *r, P p, int back) {
+  P f = back ? r->os : r->bs, t = back ? r->bs : r->os;
+  for (int i = 0; i < r->nsp; i++) {
+    P a = back ? r->sp[i].o : r->sp[i].b, b = back ? r->sp[i].b : r->sp[i].o;
+    if (f+a <= p && p <= f+a+r->sp[i].n) return t+b + p-(f+a);
+  }
+  return BADIP;
+}
+
+//tiers up the running function, moving its frame into the new body
+//ip is right after the loop's opening
+S void osr() {
+  tierup(cur);
+  Tier *r = hot[cur].tr;
+  if (!r || r->bs != start || r->be != end) return; //an older definition
+  P p = tmap(r, ip, 0);
+  if (p == BADIP) return;
+  ip = p;
+  start = r->os;
+  end = r->oe;
+}
+
+//moves a frame running the optimized body back into the baseline
+#define UNTIER(s,e,p) do { \
+  if (s == r->os && e == r->oe) { \
+    P b = tmap(r, p, 1); \
+    if (b == BADIP) fail(E_CODE, "Can't deoptimize `%s`\n", nm[id]); \
+    s = r->bs; \
+    e = r->be; \
+    p = b; \
+  } \
+} while(0)
+
+S void deopt(T id) {
+  Tier *r = hot[id].tr;
+  hot[id].tr = 0;
+  hot[id].t = ++hot[id].d >= MAXDEOPT;
+  if (fn[id].start == r->os && fn[id].end == r->oe) {
+    fn[id].start = r->bs;
+    fn[id].end = r->be;
+  }
+  UNTIER(start, end, ip);
+  for (int i = 0; i < fp; i++) UNTIER(fr[i].start, fr[i].end, fr[i].ip);
+  for (int i = 0; i < r->nd; i++) hot[r->dep[i]].used--;
+  free(r->sp);
+  free(r->dep);
+  free(r->dv);
+  free(r);
+}
+
+//`id` gets a new definition: the code assuming the old one goes
+S void redef(T id) {
+  hot[id].v++;
+  hot[id].t = hot[id].d >= MAXDEOPT;
+  mstale = 1;
+  if (hot[id].tr) deopt(id);
+  if (hot[id].used) for (T i = 0; i < np && hot[id].used; i++) {
+    Tier *r = hot[i].tr;
+    for (int j = 0; r && j < r->nd; j++)
+      if (hot[r->dep[j]].v != r->dv[j]) {
+        deopt(i);
+        break;
+      }
+  }
+}
+
+/* Memoization (id.memo). A function is pure when its body has a fixed
+   effect on the stack: no `:`, no calls but of pure functions and #laff,
+   `$` with literal indices only, loops with balanced bodies and #i and
+   #j inside its own #do only. A is the function's own, as run() starts
+   it at 0 and the return restores the caller's. Such a function replaces
+   the IN values below with OUT values computed from them, so a call with
+   the same IN values can skip the run. A self recursive function gets
+   its arity by trying the guesses, until one analyzes into itself.
+   The table of a memoized function has MEMOS sets of MEMOW entries, the
+   least recently used entry of the set getting replaced. Redefining the
+   function, or one it calls, clears the table, or drops it when the
+   function isn't pure anymore.
+*/
+#define MEMOA 4 //most values in and out
+#define MEMOS 64
+#define MEMOW 4
+#define MAXPA 16 //nested calls analyzed
+
+typedef struct { T a[MEMOA], r[MEMOA]; uint32_t use; } Me;
+
+struct Memo {
+  int in, out;
+  uint32_t hit, miss, clk;
+  T *dep;       //the functions analyzed
+  uint32_t *dv; //and their versions
+  int nd;
+  Me e[MEMOS*MEMOW];
+};
+
+S T ms[MAXFR*(MEMOA+1)]; //the args of the runs to keep, with their count
+S int msp;
+S T *mids; //the memoized functions
+S int nmids;
+S T pa[MAXPA]; //the functions being analyzed
+S int npa, pg[2], pgu; //the guess for the first, used
+S T pdep[MAXDEP];
+S int npdep;
+
+S int mfresh(Memo *m) {
+  for (int j = 0; j < m->nd; j++) if (hot[m->dep[j]].v != m->dv[j]) return 0;
+  return 1;
+}
+
+S int pdadd(T id) {
+  int i = 0;
+  while (i < npdep && pdep[i] != id) i++;
+  if (i == MAXDEP) return 0;
+  if (i == npdep) pdep[npdep++] = id;
+  return 1;
+}
+
+#define NEED(k) do { if (d-(k) < lo) lo = d-(k); } while(0)
+
+//the stack effect of the body of `id`, 0 when it isn't pure
+S int arity(T id, int *in, int *out) {
+  if (id == SI_LAF) { //acc a b: acc changes
+    *in = 3;
+    *out = 1;
+    return 1;
+  }
+  if (id < 0 || id >= np || !fn[id].end) return 0;
+  for (int i = 0; i < npa; i++) if (pa[i] == id) {
+    if (i) return 0; //mutual recursion
+    *in = pg[0];
+    *out = pg[1];
+    pgu = 1;
+    return 1;
+  }
+  Memo *m = hot[id].mt;
+  if (m && mfresh(m)) { //known already, with what it depends on
+    for (int j = 0; j < m->nd; j++) if (!pdadd(m->dep[j])) return 0;
+    *in = m->in;
+    *out = m->out;
+    return 1;
+  }
+  if (npa == MAXPA || !pdadd(id)) return 0;
+  P p = fn[id].start, e = fn[id].end;
+  if (hot[id].tr && p == hot[id].tr->os) {
+    p = hot[id].tr->bs;
+    e = hot[id].tr->be;
+  }
+  struct { int op, d; } c[64];
+  int d = 0, lo = 0, r = 0, rdp = 0, nc = 0, ndo = 0, lit = 0, ok = 1, op;
+  int ci, co;
+  T v, lv = 0;
+  pa[npa++] = id;
+  while (ok && p < e) {
+    int was = lit;
+    lit = 0;
+    p = dec(code, p, e, &op, &v);
+    switch (op) {
+    case C_BCD: d++; lit = 1; lv = v; break;
+    case C_ADD: case C_SUB: case C_MUL: NEED(2); d--; break;
+    case C_SWP: NEED(2); break;
+    case C_RDA: case C_POP: NEED(1); d--; break;
+    case C_STA: d++; break;
+    case C_RWS:
+      if (!was || lv >= MAXSP || lv <= -MAXSP) ok = 0;
+      else if (lv >= 0) { //pops I, pushes the value I deep
+        d--;
+        NEED(lv+1);
+        d++;
+      } else { //pops I and V, storing V -I deep
+        d--;
+        NEED(1);
+        d--;
+        if (d+lv < lo) lo = d+lv;
+      }
+      break;
+    case C_RUN:
+      ok = was && arity(lv, &ci, &co);
+      if (ok) {
+        d--;
+        NEED(ci);
+        d += co-ci;
+      }
+      break;
+    case C_RET:
+      ok = !r || rdp == d;
+      r = 1;
+      rdp = d;
+      break;
+    case C_JAO: case C_JBO:
+      NEED(1);
+      d--;
+      if (nc == 64) ok = 0;
+      else c[nc].op = op, c[nc++].d = d;
+      break;
+    case C_JAC: case C_JBC:
+      ok = nc && c[nc-1].op == op-1 && c[nc-1].d == d;
+      nc--;
+      break;
+    case C_EXT:
+      if (v == X_DO) {
+        NEED(1);
+        d--;
+        if (nc == 64) ok = 0;
+        else c[nc].op = v, c[nc++].d = d, ndo++;
+      } else if (v == X_LOOP) {
+        ok = nc && c[nc-1].op == X_DO && c[nc-1].d == d;
+        nc--;
+        ndo--;
+      } else if (v == X_I || v == X_J) {
+        ok = ndo >= 1 + (v == X_J);
+        d++;
+      } else if (v >= X_DIV && v <= X_SHR) {
+        NEED(2);
+        d--;
+      } else ok = 0;
+      break;
+    default: ok = 0; //`:`
+    }
+  }
+  npa--;
+  if (!ok || nc || (r && rdp != d)) return 0;
+  *in = -lo;
+  *out = d-lo;
+  return 1;
+}
+
+//the arity of `id`, checking the guesses for a self recursive one
+S int mpure(T id, int *in, int *out) {
+  if (id < 0 || id >= np || !fn[id].end) return 0;
+  for (int g = 0; g < (MEMOA+1)*(MEMOA+1); g++) {
+    npa = npdep = pgu = 0;
+    pg[0] = g/(MEMOA+1);
+    pg[1] = g%(MEMOA+1);
+    int ok = arity(id, in, out);
+    if (!pgu) return ok;
+    if (ok && *in == pg[0] && *out == pg[1]) return 1;
+  }
+  return 0;
+}
+
+S uint32_t mhash(Memo *m, T *a) {
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < m->in; i++) h = (h ^ (uint32_t)a[i]) * 16777619u;
+  return (h ^ h>>16) % MEMOS;
+}
+
+//looks the args up: -1 on a hit, with the results in their place,
+//1 when the results are to be kept on the return, 0 when they can't be
+S int mget(Memo *m) {
+  if (sp < m->in || msp+MEMOA+1 > (int)(sizeof(ms)/sizeof(T))) return 0;
+  T *a = st+sp-m->in;
+  Me *e = m->e + mhash(m, a)*MEMOW;
+  for (int i = 0; i < MEMOW; i++, e++)
+    if (e->use && !memcmp(e->a, a, m->in*sizeof(T))) {
+      e->use = ++m->clk;
+      m->hit++;
+      sp -= m->in;
+      for (int j = 0; j < m->out; j++) push(e->r[j]);
+      return -1;
+    }
+  m->miss++;
+  memcpy(ms+msp, a, m->in*sizeof(T));
+  msp += m->in;
+  ms[msp++] = m->in;
+  return 1;
+}
+
+//keeps the results of the run just returned
+S void mput(Memo *m) {
+  int n = ms[--msp];
+  msp -= n;
+  if (!m || m->in != n || sp < m->out) return;
+  Me *e = m->e + mhash(m, ms+msp)*MEMOW, *v = e;
+  for (int i = 1; i < MEMOW; i++) if (e[i].use < v->use) v = e+i;
+  memcpy(v->a, ms+msp, n*sizeof(T));
+  memcpy(v->r, st+sp-m->out, m->out*sizeof(T));
+  v->use = ++m->clk;
+}
+
+//analyzes `id` into its table, dropping it when `id` isn't pure
+S int mredo(T id) {
+  Memo *m = hot[id].mt;
+  int in, out;
+  hot[id].mt = 0; //not to be taken for known
+  if (!mpure(id, &in, &out) || in > MEMOA || out > MEMOA) {
+    free(m->dep);
+    free(m->dv);
+    free(m);
+    return 0;
+  }
+  hot[id].mt = m;
+  m->in = in;
+  m->out = out;
+  m->dep = realloc(m->dep, npdep*sizeof(T));
+  m->dv = realloc(m->dv, npdep*sizeof(uint32_t));
+  for (int i = 0; i < npdep; i++) {
+    m->dep[i] = pdep[i];
+    m->dv[i] = hot[pdep[i]].v;
+  }
+  m->nd = npdep;
+  memset(m->e, 0, sizeof(m->e));
+  return 1;
+}
+
+//redoes the tables of the functions whose definitions changed
+S void mcheck() {
+  mstale = 0;
+  for (int i = 0; i < nmids; i++) {
+    if (!mfresh(hot[mids[i]].mt) && !mredo(mids[i])) mids[i--] = mids[--nmids];
+  }
+}
+
+//id.memo: keeps the results of the function, failing when it isn't pure
+S void nmemo() {
+  T id = pop;
+  if (id < 0 || id >= np || !fn[id].end) fail(E_CALL, "Bad function `%d`\n", id);
+  if (mstale) mcheck();
+  if (hot[id].mt) return;
+  hot[id].mt = calloc(1, sizeof(Memo));
+  if (!mredo(id)) fail(E_CALL, "`%s` isn't pure or takes too many values\n", nm[id]);
+  mids = realloc(mids, (nmids+1)*sizeof(T));
+  mids[nmids++] = id;
+}
+
+/* .b4c image:
+     header, code, symbols (0 terminated names), extents, jump targets,
+     symbol reference sites, exported and imported ids
+   Sections are 16 bytes aligned. All fields are in host byte order,
+   so a foreign image fails the version check.
+   Images compiled from source are modules: the sites tell which literals
+   are name ids, so the linker can renumber them.
+*/
+typedef struct {
+  char magic[4];
+  uint32_t ver;  //B4C_VER
+  uint32_t lenc; //literal encoding
+  uint32_t csz;  //code size in nibbles
+  uint32_t coff;
+  uint32_t nsym, soff, ssz;
+  uint32_t nfx, foff;
+  uint32_t joff; //0, if there are no resolved jump targets
+  uint32_t nsr, sroff; //sites, sorted
+  uint32_t nex, exoff; //ids of the named top level definitions
+  uint32_t nim, imoff; //ids of the names used, but not defined
+} B4H;
+
+#define ALIGN16(x) (((x)+15)&~15)
+
+//writes sz bytes at b to the path, freeing b
+//goes through a temporary, so readers never map a partial file
+S void bwrite(char *path, char *b, uint32_t sz) {
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) fail(E_IO, "Can't create `%s`\n", tmp);
+  for (uint32_t o = 0; o < sz; ) {
+    ssize_t w = write(fd, b+o, sz-o);
+    if (w <= 0) fail(E_IO, "Can't write `%s`\n", tmp);
+    o += w;
+  }
+  close(fd);
+  free(b);
+  if (rename(tmp, path)) fail(E_IO, "Can't create `%s`\n", path);
+}
+
+//saves n nibbles at q, with jt being their jump targets, offset by base
+//sr are the symbol reference sites, when known
+S void b4save(char *path, C *q, P n, P *jt, P base, P *sr, int nsr) {
+  B4H h = {.magic = B4C_MAGIC, .ver = B4C_VER, .lenc = B4C_BCD, .csz = n};
+  Fx *x;
+  int k = fscan(q, n, &x);
+  //the names as of now, as the server's reader may be adding more
+  pthread_mutex_lock(&nmlock);
+  int nn = np;
+  pthread_mutex_unlock(&nmlock);
+  //exports are the definitions with named ids, the rest are imports
+  uint32_t *ex = malloc((k+nsr+1)*sizeof(*ex)), *im = ex+k;
+  char *def = calloc(nn+1, 1), *use = calloc(nn+1, 1);
+  for (int i = 0, j = 0; i < k; i++) {
+    while (j < nsr && sr[j] < x[i].def) j++;
+    if (j < nsr && sr[j] == x[i].def && x[i].id >= 0 && x[i].id < nn && !def[x[i].id]) {
+      def[x[i].id] = 1;
+      ex[h.nex++] = x[i].id;
+    }
+  }
+  for (int i = 0; i < nsr; i++) {
+    int op;
+    T v;
+    dec(q, sr[i], n, &op, &v);
+    if (v >= npre && v < nn && !def[v] && !use[v]) {
+      use[v] = 1;
+      im[h.nim++] = v;
+    }
+  }
+  free(def);
+  free(use);
+  h.coff = ALIGN16(sizeof(h));
+  h.nsym = nn;
+  h.soff = ALIGN16(h.coff + (n+1)/2);
+  for (int i = 0; i < nn; i++) h.ssz += strlen(nm[i])+1;
+  h.nfx = k;
+  h.foff = ALIGN16(h.soff + h.ssz);
+  uint32_t sz = h.foff + k*sizeof(*x);
+  if (jt) {
+    h.joff = ALIGN16(sz);
+    sz = h.joff + n*sizeof(P);
+  }
+  h.nsr = nsr;
+  h.sroff = ALIGN16(sz);
+  h.exoff = ALIGN16(h.sroff + nsr*sizeof(P));
+  h.imoff = ALIGN16(h.exoff + h.nex*sizeof(*ex));
+  sz = h.imoff + h.nim*sizeof(*im);
+  char *b = calloc(1, sz);
+  memcpy(b, &h, sizeof(h));
+  memcpy(b+h.coff, q, (n+1)/2);
+  char *p = b+h.soff;
+  for (int i = 0; i < nn; i++) p = stpcpy(p, nm[i]) + 1;
+  memcpy(b+h.foff, x, k*sizeof(*x));
+  free(x);
+  memcpy(b+h.sroff, sr, nsr*sizeof(P));
+  memcpy(b+h.exoff, ex, h.nex*sizeof(*ex));
+  memcpy(b+h.imoff, im, h.nim*sizeof(*im));
+  free(ex);
+  if (jt) {
+    P *t = (P*)(b+h.joff);
+    for (P i = 0; i < n; i++) t[i] = jt[i] == BADIP ? BADIP : jt[i]-base;
+  }
+  bwrite(path, b, sz);
+}
+
+/* Code heap.
+   Every command, `{...}` block and image gets appended to a single heap,
+   so the functions they define stay valid for the VM's lifetime.
+   Pieces start at even nibbles, so they are copied as whole bytes.
+   A VM starting with an image uses the mapped image as its heap,
+   copying it only once something gets appended.
+*/
+S P hsz;       //nibbles used
+S size_t hcap; //bytes allocated for code, 0 while it is mapped
+S size_t jcap; //entries allocated for jtbl, 0 while it is mapped
+
+//makes room for n more nibbles
+S void hgrow(P n) {
+  size_t need = hsz + (hsz&1) + n;
+  if ((need+1)/2 > hcap) {
+    size_t c = hcap ? hcap : 4096;
+    while (c < (need+1)/2) c *= 2;
+    C *q = hcap ? realloc(code, c) : malloc(c);
+    if (!hcap && hsz) memcpy(q, code, (hsz+1)/2);
+    code = q;
+    hcap = c;
+  }
+  if (need > jcap) {
+    size_t c = jcap ? jcap : 8192;
+    while (c < need) c *= 2;
+    P *t = jcap ? realloc(jtbl, c*sizeof(P)) : malloc(c*sizeof(P));
+    if (!jcap && hsz) memcpy(t, jtbl, hsz*sizeof(P));
+    for (size_t i = hsz; i < c; i++) t[i] = BADIP;
+    jtbl = t;
+    jcap = c;
+  }
+}
+
+//appends n nibbles, returning where they start
+S P hput(C *q, P n) {
+  hgrow(n);
+  if (hsz&1) code[hsz++/2] &= 0xF;
+  P s = hsz;
+  memcpy(code + s/2, q, (n+1)/2);
+  hsz += n;
+  return s;
+}
+
+//maps and checks an image, returning 0 on failure
+S B4H *imap(char *path, size_t *omsz, char **err) {
+  void *map = MAP_FAILED;
+  size_t msz = 0;
+  int fd = open(path, O_RDONLY);
+  struct stat s;
+  *err = "Can't open";
+  if (fd < 0 || fstat(fd, &s)) {
+    if (fd >= 0) close(fd);
+    return 0;
+  }
+  msz = s.st_size;
+  if (msz >= sizeof(B4H))
+    map = mmap(0, msz, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  *err = "Can't map";
+  if (map == MAP_FAILED) return 0;
+  B4H *h = map;
+  *err = "Bad image";
+  if (memcmp(h->magic, B4C_MAGIC, 4) || h->ver != B4C_VER
+      || h->lenc != B4C_BCD) {
+    munmap(map, msz);
+    return 0;
+  }
+  *err = "Truncated image";
+  uint64_t csz = h->csz;
+  if (csz > INT32_MAX || h->coff + (csz+1)/2 > msz
+      || (uint64_t)h->soff + h->ssz > msz
+      || h->foff + (uint64_t)h->nfx*sizeof(Fx) > msz
+      || (h->joff && h->joff + csz*sizeof(P) > msz)
+      || h->sroff + (uint64_t)h->nsr*sizeof(P) > msz
+      || h->exoff + (uint64_t)h->nex*4 > msz || h->imoff + (uint64_t)h->nim*4 > msz) {
+    munmap(map, msz);
+    return 0;
+  }
+  //the extents, jump targets and sites must stay in the code
+  *err = "Bad image";
+  Fx *x = (Fx*)((char*)map + h->foff);
+  P *jt = (P*)((char*)map + h->joff), *sr = (P*)((char*)map + h->sroff);
+  int bad = 0;
+  for (uint32_t i = 0; !bad && i < h->nfx; i++)
+    bad = x[i].def < 0 || x[i].def > x[i].start || x[i].start > x[i].end
+      || x[i].end >= (P)csz || (i && x[i].start <= x[i-1].start);
+  for (uint32_t i = 0; !bad && h->joff && i < csz; i++)
+    bad = jt[i] != BADIP && (jt[i] < 0 || jt[i] > (P)csz);
+  for (uint32_t i = 0; !bad && i < h->nsr; i++) bad = sr[i] < 0 || sr[i] >= (P)csz;
+  if (bad) {
+    munmap(map, msz);
+    return 0;
+  }
+  char *p = (char*)map + h->soff, *e = p+h->ssz;
+  *err = "Bad names in";
+  for (uint32_t i = 0; i < h->nsym; i++) {
+    if (p == e || !memchr(p, 0, e-p)) {
+      munmap(map, msz);
+      return 0;
+    }
+    p += strlen(p)+1;
+  }
+  *omsz = msz;
+  return h;
+}
+
+//maps the image into the heap, returning its code size
+//on an empty heap, `code` points directly into the mapped pages
+//the mapping is private, so the pages are shared with the page cache,
+//until a jump target missing from a warm image gets resolved
+//when `soft`, returns -1 on failure, instead of failing
+S P b4load(char *path, int soft, P *ostart) {
+  size_t msz;
+  char *err;
+  B4H *h = imap(path, &msz, &err);
+  char *b = (char*)h;
+  if (!h) {
+    if (soft) return -1;
+    fail(E_IO, "%s `%s`\n", err, path);
+  }
+  //the image's ids must keep their meaning in our name table
+  //held throughout, so the server's reader can't intern a name between
+  pthread_mutex_lock(&nmlock);
+  char *p = b+h->soff;
+  int bad = h->nsym < (uint32_t)np;
+  for (uint32_t i = 0; !bad && i < (uint32_t)np; i++, p += strlen(p)+1)
+    bad = strcmp(nm[i], p);
+  p = b+h->soff;
+  for (uint32_t i = 0; !bad && i < h->nsym; i++, p += strlen(p)+1) bad = isym(p, 1) < 0;
+  pthread_mutex_unlock(&nmlock);
+  if (bad) {
+    munmap(h, msz);
+    if (soft) return -1;
+    fail(E_IO, "Symbol table mismatch in `%s`\n", path);
+  }
+  P n = h->csz, o;
+  P *jt = h->joff ? (P*)(b + h->joff) : 0;
+  if (!hsz && !hcap) { //run in place
+    code = (C*)b + h->coff;
+    hsz = n;
+    o = 0;
+    if (jt) jtbl = jt;
+    else {
+      jtbl = malloc(n*sizeof(P));
+      for (P i = 0; i < n; i++) jtbl[i] = BADIP;
+      jcap = n;
+    }
+  } else {
+    o = hput((C*)b + h->coff, n);
+    if (jt) for (P i = 0; i < n; i++) if (jt[i] != BADIP) jtbl[o+i] = jt[i]+o;
+  }
+  Fx *x = (Fx*)(b + h->foff);
+  fx = realloc(fx, (nfx+h->nfx)*sizeof(*fx));
+  for (uint32_t i = 0; i < h->nfx; i++, nfx++) {
+    fx[nfx] = x[i];
+    fx[nfx].def += o;
+    fx[nfx].start += o;
+    fx[nfx].end += o;
+  }
+  if (o) munmap(h, msz);
+  *ostart = o;
+  return n;
+}
+
+S int fbase; //frloop returns, once fp drops to it
+
+S void frloop() {
+  for (;;) {
+    exe();
+    if (fr[--fp].mm) mput(hot[cur].mt);
+    if (fp == fbase) return;
+    ip = fr[fp].ip;
+    start = fr[fp].start;
+    end = fr[fp].end;
+    ra = fr[fp].ra;
+    cur = fr[fp].id;
+    lsp = fr[fp].lsp; //a return unwinds the loops
+  }
+}
+
+//runs code[s..e) in the middle of whatever the VM is doing
+S void nest(P s, P e) {
+  int b = fbase;
+  fbase = fp;
+  fr[fp].mm = 0;
+  fr[fp].id = cur;
+  fr[fp].ra = ra;
+  fr[fp].lsp = lsp;
+  fr[fp].ip = ip;
+  fr[fp].start = start;
+  fr[fp++].end = end;
+  start = ip = s;
+  end = e;
+  ra = 0;
+  cur = -1;
   frloop();
+  ip = fr[fp].ip;
+  start = fr[fp].start;
+  end = fr[fp].end;
+  ra = fr[fp].ra;
+  cur = fr[fp].id;
+  lsp = fr[fp].lsp;
+  fbase = b;
+}
+
+/* eval: assembles the 0 terminated string on the stack into the heap,
+   pushing the id of a function running it. The functions are cached
+   by the source text, so evaluating the same string again is a lookup,
+   unless it uses macros, intern or blocks, like b4run.
+*/
+typedef struct { uint64_t key; char *src; T id; } Ev;
+S Ev *ev;
+S uint32_t evcap, nev, nevid; //nevid: the names given
+
+//pops a 0 terminated string, like `say` does
+S char *spop() {
+  int e = sp, s = sp;
+  while (s && st[s-1]) s--;
+  char *t = malloc(e-s+1);
+  for (int i = s; i < e; i++) t[i-s] = st[i];
+  t[e-s] = 0;
+  sp = s ? s-1 : 0;
+  return t;
+}
+
+S uint64_t b4hash(char *s);
+
+S void evl() {
+  char *t = spop();
+  uint64_t key = b4hash(t);
+  if (nev*2 >= evcap) {
+    Ev *o = ev;
+    uint32_t oc = evcap;
+    evcap = evcap ? evcap*2 : 64;
+    ev = calloc(evcap, sizeof(Ev));
+    for (uint32_t i = 0; i < oc; i++) if (o[i].src) {
+      uint32_t h = o[i].key;
+      while (ev[h&(evcap-1)].src) h++;
+      ev[h&(evcap-1)] = o[i];
+    }
+    free(o);
+  }
+  uint32_t h = key;
+  for (; ev[h&(evcap-1)].src; h++) {
+    if (ev[h&(evcap-1)].key == key && !strcmp(ev[h&(evcap-1)].src, t)) {
+      push(ev[h&(evcap-1)].id);
+      free(t);
+      return;
+    }
+  }
+  char n[32];
+  snprintf(n, sizeof(n), "#eval%u", nevid++);
+  T id = sym(n);
+  Asm a;
+  asmstr(&a, t);
+  free(a.sr);
+  free(a.buf);
+  fn[id].start = hput(a.q, a.ip);
+  fn[id].end = fn[id].start + a.ip;
+  free(a.q);
+  if (a.dyn) {
+    free(t);
+    push(id);
+    return;
+  }
+  ev[h&(evcap-1)].key = key;
+  ev[h&(evcap-1)].src = t;
+  ev[h&(evcap-1)].id = id;
+  nev++;
+  push(id);
+}
+
+S char *warm; //where to save the image with the resolved jumps
+
+S int heatcmp(const void *a, const void *b) {
+  int i = *(int*)a, j = *(int*)b;
+  T x = sfx[i].id, y = sfx[j].id;
+  uint64_t hx = x >= 0 && x < MAXFN ? (uint64_t)hot[x].n + hot[x].b : 0;
+  uint64_t hy = y >= 0 && y < MAXFN ? (uint64_t)hot[y].n + hot[y].b : 0;
+  return hx != hy ? (hx < hy) - (hx > hy) : i - j;
+}
+
+//saves code[s..s+n) as the warm image, with each run of adjacent
+//definitions sorted by heat; a run defining an id twice stays as is,
+//since the last definition must win
+//a jump landing where a definition starts lands on the run's start,
+//so only the targets inside the bodies move with them
+//a definition with a computed id could be of any of them, so then
+//nothing moves
+S void b4warm(P s, P n) {
+  C *q = code+s/2;
+  Fx *x;
+  int k = fscan(q, n, &x);
+  if (nfdyn) k = 0;
+  P *mv = malloc((n+1)*sizeof(P)), *src = malloc((n+1)*sizeof(P));
+  int *ord = malloc((k+1)*sizeof(int));
+  char *seen = calloc(MAXFN, 1), *bd = calloc(n+1, 1);
+  for (P i = 0; i <= n; i++) mv[i] = i;
+  sfx = x;
+  for (int i = 0, j; i < k; i = j) {
+    int dup = 0;
+    for (j = i; j < k && (j == i || x[j].def == x[j-1].end+1); j++) {
+      T id = x[j].id;
+      if (id < 0 || id >= MAXFN || seen[id]++) dup = 1;
+      ord[j-i] = j;
+    }
+    for (int d = i; d < j; d++) if (x[d].id >= 0 && x[d].id < MAXFN) seen[x[d].id] = 0;
+    if (dup || j-i < 2) continue;
+    qsort(ord, j-i, sizeof(int), heatcmp);
+    P at = x[i].def;
+    for (int d = 0; d < j-i; d++) {
+      Fx *f = x+ord[d];
+      bd[f->def] = 1;
+      for (P p = f->def; p <= f->end; p++) mv[p] = at++;
+    }
+  }
+  for (P i = 0; i < n; i++) src[mv[i]] = i;
+  Asm o = {0};
+  for (P i = 0; i < n; i++) anib(&o, nib(q, src[i]));
+  P *jt = malloc((n+1)*sizeof(P));
+  for (P i = 0; i < n; i++) {
+    P t = jtbl[s+i];
+    jt[mv[i]] = t == BADIP || t < s || t > s+n ? BADIP : bd[t-s] ? t-s : mv[t-s];
+  }
+  b4save(warm, o.q, n, jt, 0, 0, 0);
+  free(o.q);
+  free(jt);
+  free(x);
+  free(mv);
+  free(src);
+  free(ord);
+  free(seen);
+  free(bd);
+}
+
+//executes code[s..s+n)
+S void b4exec(P s, P n) {
+  int entry = sym("_entry");
+  redef(entry);
+  fn[entry].start = s;
+  fn[entry].end = s+n;
+  if (n) { //an empty end would mean a native
+    run(entry);
+    frloop();
+  }
 
-  free(code);
-  free(jtbl);
-  code = 0;
-  jtbl = 0;
+  if (warm) b4warm(s, n);
+}
+
+/* Compilation cache.
+   Compiled commands are keyed by a hash of the VM version and the source.
+   In process, the last LRUSZ commands are remembered with their place
+   in the heap, keeping their jump targets warm.
+   With a cache directory (-c or B4CACHE), compiled images are stored there
+   after their first run, so the later processes just map them.
+   Commands using macros, intern or `{...}` blocks are never cached, as
+   their code depends on the VM state, not just on the source.
+*/
+#define LRUSZ 16
+
+S struct {
+  uint64_t key;
+  P start, n;
+  uint32_t use;
+} lru[LRUSZ];
+S uint32_t lruclk;
+S char *cdir; //on-disk cache directory
+
+S uint64_t b4hash(char *s) {
+  uint64_t h = 0xcbf29ce484222325ULL ^ B4C_VER; //FNV-1a
+  for (; *s; s++) h = (h ^ (uint8_t)*s) * 0x100000001b3ULL;
+  return h;
+}
+
+S char *cpath(uint64_t key) {
+  S char p[4096];
+  snprintf(p, sizeof(p), "%s/%016llx.b4c", cdir, (unsigned long long)key);
+  return p;
+}
+
+//runs the command, `pre` being its assembly, when it's done already
+S void b4run(char *command, Asm *pre) {
+  if (!ready) init();
+
+  uint64_t key = b4hash(command) ^ shake ^ (opt&OPT_VAL ? opt&~OPT_TIER : 0)<<2;
+  int i, fresh = 0, dyn = 0;
+  P s, n;
+  for (i = 0; i < LRUSZ && !(lru[i].use && lru[i].key == key); i++);
+  if (i == LRUSZ) { //miss: replace the least recently used
+    i = 0;
+    for (int j = 1; j < LRUSZ; j++) if (lru[j].use < lru[i].use) i = j;
+    if (!cdir || (n = b4load(cpath(key), 1, &s)) < 0) {
+      Asm a;
+      if (pre) a = *pre, pre = 0;
+      else asmstr(&a, command);
+      if (shake) ashake(&a);
+      if (opt&OPT_VAL) aopt(&a);
+      s = hput(a.q, a.ip);
+      n = a.ip;
+      free(a.q);
+      free(a.sr);
+      dyn = a.dyn;
+      fresh = !dyn;
+    }
+    if (!dyn) {
+      lru[i].key = key;
+      lru[i].start = s;
+      lru[i].n = n;
+    }
+  } else {
+    s = lru[i].start;
+    n = lru[i].n;
+  }
+  if (pre) { //not needed after all
+    free(pre->q);
+    free(pre->sr);
+  }
+  if (!dyn) lru[i].use = ++lruclk;
+
+  obs("Code size: ");
+  obint((n+1)/2);
+  obs(" bytes\n");
+
+  b4exec(s, n);
+  if (fresh && cdir) b4save(cpath(key), code+s/2, n, jtbl+s, s, 0, 0);
+}
+
+//resets the execution state after a failure
+S void reset() {
+  sp = fp = fbase = lsp = mdepth = msp = 0;
+  ra = 0;
+  cur = -1;
+}
+
+//runs the command, returning 0, or the error, after which the VM
+//is reset and usable again
+S B4Err *b4catch(char *command, Asm *pre) {
+  jmp_buf jb, *o = onfail;
+  onfail = &jb;
+  if (setjmp(jb)) {
+    onfail = o;
+    reset();
+    return &err;
+  }
+  b4run(command, pre);
+  onfail = o;
+  return 0;
+}
+
+B4Err *b4cmd(char *command) {return b4catch(command, 0);}
+
+//compiles the command, or the source file when `file` is set,
+//into a .b4c image
+void b4compile(char *path, char *command, char *file) {
+  Asm a;
+  if (!ready) init();
+  if (file) asmfile(&a, file);
+  else asmstr(&a, command);
+  if (shake) ashake(&a);
+  if (opt&OPT_VAL) aopt(&a);
+  b4save(path, a.q, a.ip, 0, 0, a.sr, a.nsr);
+  free(a.q);
+  free(a.sr);
+}
+
+/* Linker.
+   Concatenates the modules, renumbering the name ids at their sites,
+   since b4 code needs no other relocation. A definition identical to
+   the previous definition of the same id is dropped, when both are at
+   the top level outside of any bracket, so both surely run, and no
+   definition with a computed id comes between.
+*/
+void b4link(char *path, char **in, int nin) {
+  if (!ready) init();
+  Asm o = {0};
+  P *ld = malloc(MAXFN*sizeof(P)), *ln = calloc(MAXFN, sizeof(P));
+  char *exp = calloc(MAXNP, 1);
+  int depth = 0; //of the brackets around the top level code
+  for (int f = 0; f < nin; f++) {
+    size_t msz;
+    char *err;
+    B4H *h = imap(in[f], &msz, &err);
+    if (!h) fail(E_IO, "%s `%s`\n", err, in[f]);
+    char *b = (char*)h, *p = b+h->soff;
+    C *q = (C*)b + h->coff;
+    P *sr = (P*)(b+h->sroff);
+    Fx *x = (Fx*)(b+h->foff);
+    uint32_t *ex = (uint32_t*)(b+h->exoff);
+    T *rm = malloc((h->nsym+1)*sizeof(T));
+    for (uint32_t i = 0; i < h->nsym; i++, p += strlen(p)+1) rm[i] = sym(p);
+    for (uint32_t i = 0; i < h->nex; i++) if (ex[i] < h->nsym) exp[rm[ex[i]]] = 1;
+    uint32_t si = 0, k = 0;
+    P dstart = -1, dend = 0, d0 = 0, nx = 0; //nx: the next top level op
+    T did = 0;
+    for (P i = 0; i < (P)h->csz; ) {
+      if (k < h->nfx && i == x[k].def) {
+        dstart = o.ip;
+        nx = dend = x[k].end+1;
+        did = x[k].id;
+        if (si < h->nsr && sr[si] == i && did >= 0 && (uint32_t)did < h->nsym)
+          did = rm[did];
+        d0 = o.nsr;
+        k++;
+      } else if (dstart < 0 && i == nx) {
+        int op;
+        T v;
+        nx = dec(q, i, h->csz, &op, &v);
+        if (op == C_EXT && (v == X_DO || v == X_LOOP)) op = v == X_DO ? C_JAO : C_JAC;
+        if (op == C_JAO || op == C_JBO) depth++;
+        if (op == C_JAC || op == C_JBC) depth--;
+        if (op == C_DFN) { //a computed id might be any of them
+          while (nx < (P)h->csz && (nx = dec(q, nx, h->csz, &op, &v), op != C_DFN));
+          memset(ln, 0, MAXFN*sizeof(P));
+        }
+      }
+      if (si < h->nsr && sr[si] == i) {
+        int op;
+        T v;
+        i = dec(q, i, h->csz, &op, &v);
+        asite(&o, o.ip);
+        emitBCD(&o, v >= 0 && (uint32_t)v < h->nsym ? rm[v] : v);
+        si++;
+      } else {
+        anib(&o, nib(q, i));
+        i++;
+      }
+      if (dstart >= 0 && i == dend) {
+        P n = o.ip - dstart;
+        if (did >= 0 && did < MAXFN && depth) ln[did] = 0;
+        else if (did >= 0 && did < MAXFN) {
+          P l = ld[did];
+          int same = ln[did] == n;
+          for (P j = 0; same && j < n; j++)
+            same = nib(o.q, l+j) == nib(o.q, dstart+j);
+          if (same) { //drop the duplicate
+            o.ip = dstart;
+            o.nsr = d0;
+            if (o.ip&1) o.q[o.ip/2] &= 0xF;
+          } else {
+            ld[did] = dstart;
+            ln[did] = n;
+          }
+        }
+        dstart = -1;
+      }
+    }
+    //imports nobody exports might still get defined at runtime
+    uint32_t *im = (uint32_t*)(b+h->imoff);
+    for (uint32_t i = 0; i < h->nim; i++) if (im[i] < h->nsym) exp[rm[im[i]]] |= 2;
+    free(rm);
+    munmap(h, msz);
+  }
+  for (int i = 0; i < np; i++)
+    if (exp[i] == 2) obf("Warning: `%s` is not defined\n", nm[i]);
+  if (shake) ashake(&o);
+  if (opt&OPT_VAL) aopt(&o);
+  b4save(path, o.q, o.ip, 0, 0, o.sr, o.nsr);
+  free(o.q);
+  free(o.sr);
+  free(ld);
+  free(ln);
+  free(exp);
+}
+
+//runs a source file, "-" being the stdin
+void b4file(char *path) {
+  Asm a;
+  if (!ready) init();
+  asmfile(&a, path);
+  if (shake) ashake(&a);
+  if (opt&OPT_VAL) aopt(&a);
+  P s = hput(a.q, a.ip);
+  free(a.q);
+  free(a.sr);
+  b4exec(s, a.ip);
+}
+
+//runs a .b4c image, executing right from the mapped file
+void b4image(char *path) {
+  P s;
+  if (!ready) init();
+  P n = b4load(path, 0, &s);
+  b4exec(s, n);
+}
+
+/* Snapshots (-s, -S).
+   A snapshot is the VM state between commands: the heap with its jump
+   targets, the names, the image extents, the functions, the stack and A.
+   Restored into a fresh VM, the file is mapped privately and used as is:
+   the heap and the jump targets like those of a warm image, and fn[] from
+   its own page aligned section, over zero pages for the ids beyond it.
+   The pages are shared until the VM writes to them, so restoring doesn't
+   depend on the size of the prelude, except for rehashing the names.
+   Linear memory and the compilation caches aren't part of it.
+*/
+#define B4S_MAGIC "b4s\x1A"
+
+typedef struct {
+  char magic[4];
+  uint32_t ver;  //B4C_VER
+  uint32_t csz, coff, joff;
+  uint32_t nsym, soff, ssz;
+  uint32_t nfx, foff;
+  uint32_t nst, stoff;
+  T ra;
+  uint32_t fnoff, nfn; //last, page aligned
+} B4S;
+
+void b4snap(char *path) {
+  B4S h = {.magic = B4S_MAGIC, .ver = B4C_VER, .csz = hsz};
+  h.coff = ALIGN16(sizeof(h));
+  h.joff = ALIGN16(h.coff + (hsz+1)/2);
+  h.nsym = np;
+  h.soff = ALIGN16(h.joff + hsz*sizeof(P));
+  for (int i = 0; i < np; i++) h.ssz += strlen(nm[i])+1;
+  h.nfx = nfx;
+  h.foff = ALIGN16(h.soff + h.ssz);
+  h.nst = sp;
+  h.stoff = ALIGN16(h.foff + nfx*sizeof(Fx));
+  h.ra = ra;
+  h.fnoff = PGUP(h.stoff + sp*sizeof(T));
+  h.nfn = np;
+  uint32_t sz = h.fnoff + np*sizeof(Fn);
+  char *b = calloc(1, sz);
+  memcpy(b, &h, sizeof(h));
+  memcpy(b+h.coff, code, (hsz+1)/2);
+  memcpy(b+h.joff, jtbl, hsz*sizeof(P));
+  char *p = b+h.soff;
+  for (int i = 0; i < np; i++) p = stpcpy(p, nm[i]) + 1;
+  memcpy(b+h.foff, fx, nfx*sizeof(Fx));
+  memcpy(b+h.stoff, st, sp*sizeof(T));
+  Fn *f = (Fn*)(b+h.fnoff);
+  memcpy(f, fn, np*sizeof(Fn));
+  for (int i = 0; i < np; i++) //the inlined code isn't tracked there
+    if (hot[i].tr && f[i].start == hot[i].tr->os) {
+      f[i].start = hot[i].tr->bs;
+      f[i].end = hot[i].tr->be;
+    }
+  bwrite(path, b, sz);
+}
+
+void b4restore(char *path) {
+  struct stat sb;
+  if (!ready) init();
+  if (hsz || hcap || np != npre)
+    fail(E_IO, "Can't restore `%s` over a used VM\n", path);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &sb)) fail(E_IO, "Can't open `%s`\n", path);
+  size_t msz = sb.st_size;
+  char *b = msz < sizeof(B4S) ? MAP_FAILED
+    : mmap(0, msz, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  B4S *h = (B4S*)b;
+  uint64_t csz = b == MAP_FAILED ? 0 : h->csz;
+  int bad = b == MAP_FAILED || memcmp(h->magic, B4S_MAGIC, 4)
+      || h->ver != B4C_VER || h->nsym < (uint32_t)npre || h->nsym > MAXNP
+      || h->nst > MAXSP || h->nfn > MAXFN || csz > INT32_MAX
+      || h->coff + (csz+1)/2 > msz
+      || h->joff + csz*sizeof(P) > msz
+      || (uint64_t)h->soff + h->ssz > msz
+      || h->foff + (uint64_t)h->nfx*sizeof(Fx) > msz
+      || h->stoff + (uint64_t)h->nst*sizeof(T) > msz
+      || h->fnoff + (uint64_t)h->nfn*sizeof(Fn) > msz
+      || h->fnoff % pgsz();
+  //the extents, jump targets and functions must stay in the heap
+  Fx *x = bad ? 0 : (Fx*)(b + h->foff);
+  P *jt = bad ? 0 : (P*)(b + h->joff);
+  Fn *fs = bad ? 0 : (Fn*)(b + h->fnoff);
+  for (uint32_t i = 0; !bad && i < h->nfx; i++)
+    bad = x[i].def < 0 || x[i].def > x[i].start || x[i].start > x[i].end
+      || x[i].end >= (P)csz || (i && x[i].start <= x[i-1].start);
+  for (uint32_t i = 0; !bad && i < csz; i++)
+    bad = jt[i] != BADIP && (jt[i] < 0 || jt[i] > (P)csz);
+  for (uint32_t i = 0; !bad && i < h->nfn; i++)
+    bad = fs[i].end && (fs[i].start < 0 || fs[i].start > fs[i].end || fs[i].end > (P)csz);
+  if (bad) {
+    if (b != MAP_FAILED) munmap(b, msz);
+    close(fd);
+    fail(E_IO, "Bad snapshot `%s`\n", path);
+  }
+  char *p = b+h->soff, *e = p+h->ssz;
+  for (uint32_t i = 0; i < h->nsym; i++, p += strlen(p)+1)
+    if (p == e || !memchr(p, 0, e-p) || (i < (uint32_t)npre && strcmp(nm[i], p))) {
+      close(fd);
+      fail(E_IO, "Bad names in `%s`\n", path);
+    }
+  p = b+h->soff;
+  for (uint32_t i = 0; i < h->nsym; i++, p += strlen(p)+1) sym(p);
+  //the ids past the snapshot's stay zero, that is undefined
+  Fn *f = mmap(0, MAXFN*sizeof(Fn), PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (f == MAP_FAILED || (h->nfn && mmap(f, h->nfn*sizeof(Fn),
+      PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, h->fnoff) == MAP_FAILED))
+    fail(E_IO, "Can't map `%s`\n", path);
+  close(fd);
+  fn = f;
+  code = (C*)b + h->coff;
+  jtbl = (P*)(b + h->joff);
+  hsz = h->csz;
+  fx = realloc(fx, h->nfx*sizeof(Fx));
+  memcpy(fx, b+h->foff, h->nfx*sizeof(Fx));
+  nfx = h->nfx;
+  memcpy(st, b+h->stoff, h->nst*sizeof(T));
+  sp = h->nst;
+  ra = h->ra;
 }
 
 void b4dump() {
-  printf("A = %d\n", ra);
+  obs("A = ");
+  obint(ra);
+  obc('\n');
   int i = sp;
-  while (i-- > 0) printf("st[%d] = %d\n", i, st[i]);
+  while (i-- > 0) {
+    obs("st[");
+    obint(i);
+    obs("] = ");
+    obint(st[i]);
+    obc('\n');
+  }
+}
+
+//prints the call and back jump counts (-p), the hottest functions first
+void b4prof() {
+  T *ids = malloc(np*sizeof(T));
+  int n = 0;
+  for (T i = 0; i < np; i++)
+    if (hot[i].n || hot[i].b || hot[i].mt) ids[n++] = i;
+  for (int i = 1; i < n; i++) //insertion sort, the list is short
+    for (int j = i; j > 0; j--) {
+      T a = ids[j-1], b = ids[j];
+      if ((uint64_t)hot[a].n+hot[a].b >= (uint64_t)hot[b].n+hot[b].b) break;
+      ids[j-1] = b;
+      ids[j] = a;
+    }
+  obs("Profile:\n");
+  obf("%10s %10s %5s %6s %10s %6s  %s\n", "calls", "jumps", "tier",
+      "deopts", "memo hits", "rate", "function");
+  for (int i = 0; i < n; i++) {
+    T id = ids[i];
+    Memo *m = hot[id].mt;
+    obf("%10u %10u %5d %6u ", hot[id].n, hot[id].b, !!hot[id].tr, hot[id].d);
+    if (!m) obf("%10s %6s", "-", "-");
+    else obf("%10u %5.1f%%", m->hit,
+             m->hit ? 100.0*m->hit/((double)m->hit+m->miss) : 0.0);
+    obf("  %s\n", nm[id]);
+  }
+  free(ids);
+}
+
+/* Server mode (-d): the commands come one per line from the stdin (-),
+   a FIFO, or the connections to a UNIX socket created at the path.
+   The VM, the names and the heap stay warm between the commands.
+   The reply to each is its output and the stack dump, ending with a line
+   holding a single `.`. A failed command resets the stack, the frames
+   and A, keeping the definitions.
+   A reader thread assembles the next commands while the VM runs the
+   current one, except those with macros, since these run VM code.
+   A `~` command runs in a fork()ed child, sharing the VM's pages until
+   it writes to them, so whatever it does is thrown away with it.
+*/
+#define MAXQ 16 //commands assembled ahead
+
+typedef struct {
+  char *cmd; //0 when the client is done
+  Asm a;
+  int pre;   //`a` holds the assembled command
+  int fd;    //where the reply goes
+  int spec;  //a what-if, leaving the VM as it was
+  int quit;
+} Job;
+
+S Job jq[MAXQ];
+S int jh, jt;
+S pthread_mutex_t jlock = PTHREAD_MUTEX_INITIALIZER;
+S pthread_cond_t jcond = PTHREAD_COND_INITIALIZER;
+
+S void jput(Job *j) {
+  pthread_mutex_lock(&jlock);
+  while (jt-jh == MAXQ) pthread_cond_wait(&jcond, &jlock);
+  jq[jt++%MAXQ] = *j;
+  pthread_cond_broadcast(&jcond);
+  pthread_mutex_unlock(&jlock);
+}
+
+S Job jget() {
+  pthread_mutex_lock(&jlock);
+  while (jt == jh) pthread_cond_wait(&jcond, &jlock);
+  Job j = jq[jh++%MAXQ];
+  pthread_cond_broadcast(&jcond);
+  pthread_mutex_unlock(&jlock);
+  return j;
+}
+
+//queues the commands read from `in`, with the replies going to `out`
+S void rclient(int in, int out) {
+  FILE *f = fdopen(dup(in), "r");
+  char *l = 0;
+  size_t cap = 0;
+  ssize_t n;
+  while (f && (n = getline(&l, &cap, f)) > 0) {
+    if (l[n-1] == '\n') l[--n] = 0;
+    Job j = {0};
+    j.spec = l[0] == '~';
+    j.cmd = strdup(l + j.spec);
+    j.fd = out;
+    if (!strpbrk(l, "({")) {
+      jmp_buf jb;
+      onfail = &jb;
+      if (!setjmp(jb)) { //a failure gets reported when it runs
+        asmstr(&j.a, j.cmd);
+        j.pre = 1;
+      }
+      onfail = 0;
+    }
+    jput(&j);
+  }
+  free(l);
+  if (f) fclose(f);
+  Job j = {0};
+  j.fd = out;
+  jput(&j);
+}
+
+S char *spath;
+S int slisten = -1;
+
+S void *reader(void *arg) {
+  (void)arg;
+  if (slisten >= 0) for (;;) {
+    int c = accept(slisten, 0, 0);
+    if (c >= 0) rclient(c, c);
+  }
+  if (!strcmp(spath, "-")) rclient(0, 1);
+  else for (;;) { //a FIFO: wait for the next writer
+    int fd = open(spath, O_RDONLY);
+    if (fd < 0) break;
+    rclient(fd, 1);
+    close(fd);
+  }
+  Job j = {0};
+  j.quit = 1;
+  jput(&j);
+  return 0;
+}
+
+void b4serve(char *path) {
+  struct stat sb;
+  pthread_t t;
+  if (!ready) init();
+  signal(SIGPIPE, SIG_IGN); //clients may go away
+  spath = path;
+  if (strcmp(path, "-") && (stat(path, &sb) || !S_ISFIFO(sb.st_mode))) {
+    struct sockaddr_un ad = {0};
+    ad.sun_family = AF_UNIX;
+    strncpy(ad.sun_path, path, sizeof(ad.sun_path)-1);
+    unlink(path);
+    slisten = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (slisten < 0 || bind(slisten, (struct sockaddr*)&ad, sizeof(ad))
+        || listen(slisten, 16)) fail(E_IO, "Can't listen at `%s`\n", path);
+  }
+  pthread_create(&t, 0, reader, 0);
+  for (;;) {
+    Job j = jget();
+    if (j.quit) break;
+    if (!j.cmd) { //the client is done
+      if (j.fd != 1) close(j.fd);
+      continue;
+    }
+    ofd = j.fd;
+    pid_t pid = 0;
+    if (j.spec) { //the reader may be interning names
+      pthread_mutex_lock(&nmlock);
+      pid = fork();
+      pthread_mutex_unlock(&nmlock);
+    }
+    if (pid) { //the clone replies, or there is none
+      if (pid > 0) waitpid(pid, 0, 0);
+      else {
+        obs("Can't fork\n.\n");
+        obflush();
+      }
+      if (j.pre) {
+        free(j.a.q);
+        free(j.a.sr);
+      }
+    } else {
+      if (j.spec) cdir = 0; //the clone's compilations die with it
+      B4Err *e = b4catch(j.cmd, j.pre ? &j.a : 0);
+      if (e) perr(e);
+      b4dump();
+      obs(".\n");
+      obflush();
+      if (j.spec) _exit(0);
+    }
+    ofd = 1;
+    free(j.cmd);
+  }
 }
 
 int main(int argc, char **argv) {
-  if (argc < 2) {
-     printf("Usage: %s <expression>\n", argv[0]);
+  char *out = 0, *img = 0, *file = 0, *lnk = 0, *srv = 0, *snap = 0, *from = 0;
+  int o, raw = 0, prof = 0;
+  cdir = getenv("B4CACHE");
+  while ((o = getopt(argc, argv, "c:d:f:Hj:Ll:o:Opr:s:S:tTw:")) != -1) switch (o) {
+  case 'O': opt |= OPT_VAL; break;
+  case 'L': raw = 1; break;
+  case 'H': opt |= OPT_TIER; hotc = 1; break;
+  case 'p': hotc = prof = 1; break;
+  case 't': shake = SHAKE_SAFE; break;
+  case 'T': shake = SHAKE_ALL; break;
+  case 'l': lnk = optarg; break;
+  case 'c': cdir = optarg; break;
+  case 'd': srv = optarg; break;
+  case 'j': jobs = atoi(optarg); break;
+  case 'f': file = optarg; break;
+  case 'o': out = optarg; break;
+  case 'r': img = optarg; break;
+  case 's': snap = optarg; break;
+  case 'S': from = optarg; break;
+  case 'w': warm = optarg; hotc = 1; break;
+  default: return -1;
+  }
+  if (opt && !raw) opt |= OPT_LOOP;
+  if (lnk) {
+    b4link(lnk, argv+optind, argc-optind);
+    return 0;
+  }
+  if (from) b4restore(from);
+  if (srv) {
+    b4serve(srv);
+    if (prof) b4prof();
+    return 0;
+  }
+  if (optind >= argc && !img && !file && !from) {
+     printf("Usage: %s [-c cachedir] [-o out.b4c] [-w warm.b4c] [-OLtT] <expression>\n"
+            "       %s [-o out.b4c] [-w warm.b4c] [-OLtT] -f source.b4\n"
+            "       %s [-w warm.b4c] -r image.b4c\n"
+            "       %s [-OLtT] -l out.b4c module.b4c...\n"
+            "       %s [-c cachedir] [-OLtT] -d -|fifo|socket\n"
+            "       tiering and profiling: [-H] [-p] with any of the runs\n"
+            "       snapshots: [-S from.b4s] [-s to.b4s] with any of the runs\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0]);
      return 0;
   }
-  b4cmd(argv[1]);
+  if (out) {
+    b4compile(out, argv[optind], file);
+    return 0;
+  }
+  if (img) b4image(img);
+  else if (file) b4file(file);
+  else if (optind < argc) {
+    B4Err *e = b4cmd(argv[optind]);
+    if (e) {
+      perr(e);
+      obflush();
+      return -1;
+    }
+  }
+  if (snap) b4snap(snap);
   b4dump();
+  if (prof) b4prof();
+  obflush();
   return 0;
 }